@@ -53,9 +53,24 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// precompute_factors_rcpp
+List precompute_factors_rcpp(const arma::mat& s_mat, const arma::mat& v_mat, NumericVector& U_3d, bool common_cov, int n_thread);
+RcppExport SEXP _mashr_precompute_factors_rcpp(SEXP s_matSEXP, SEXP v_matSEXP, SEXP U_3dSEXP, SEXP common_covSEXP, SEXP n_threadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type s_mat(s_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type v_mat(v_matSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type U_3d(U_3dSEXP);
+    Rcpp::traits::input_parameter< bool >::type common_cov(common_covSEXP);
+    Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
+    rcpp_result_gen = Rcpp::wrap(precompute_factors_rcpp(s_mat, v_mat, U_3d, common_cov, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
 // calc_lik_rcpp
-List calc_lik_rcpp(const arma::mat& b_mat, const arma::mat& s_mat, const arma::mat& v_mat, const arma::mat& l_mat, NumericVector& U_3d, NumericVector& sigma_3d, bool logd, bool common_cov, int n_thread);
-RcppExport SEXP _mashr_calc_lik_rcpp(SEXP b_matSEXP, SEXP s_matSEXP, SEXP v_matSEXP, SEXP l_matSEXP, SEXP U_3dSEXP, SEXP sigma_3dSEXP, SEXP logdSEXP, SEXP common_covSEXP, SEXP n_threadSEXP) {
+List calc_lik_rcpp(const arma::mat& b_mat, const arma::mat& s_mat, const arma::mat& v_mat, const arma::mat& l_mat, const arma::mat& m_mat, NumericVector& U_3d, NumericVector& sigma_3d, bool logd, bool common_cov, int n_thread);
+RcppExport SEXP _mashr_calc_lik_rcpp(SEXP b_matSEXP, SEXP s_matSEXP, SEXP v_matSEXP, SEXP l_matSEXP, SEXP m_matSEXP, SEXP U_3dSEXP, SEXP sigma_3dSEXP, SEXP logdSEXP, SEXP common_covSEXP, SEXP n_threadSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -63,12 +78,29 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const arma::mat& >::type s_mat(s_matSEXP);
     Rcpp::traits::input_parameter< const arma::mat& >::type v_mat(v_matSEXP);
     Rcpp::traits::input_parameter< const arma::mat& >::type l_mat(l_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type m_mat(m_matSEXP);
     Rcpp::traits::input_parameter< NumericVector& >::type U_3d(U_3dSEXP);
     Rcpp::traits::input_parameter< NumericVector& >::type sigma_3d(sigma_3dSEXP);
     Rcpp::traits::input_parameter< bool >::type logd(logdSEXP);
     Rcpp::traits::input_parameter< bool >::type common_cov(common_covSEXP);
     Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
-    rcpp_result_gen = Rcpp::wrap(calc_lik_rcpp(b_mat, s_mat, v_mat, l_mat, U_3d, sigma_3d, logd, common_cov, n_thread));
+    rcpp_result_gen = Rcpp::wrap(calc_lik_rcpp(b_mat, s_mat, v_mat, l_mat, m_mat, U_3d, sigma_3d, logd, common_cov, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
+// lik_column_keys_rcpp
+Rcpp::CharacterVector lik_column_keys_rcpp(const arma::mat& b_mat, const arma::mat& s_mat, const arma::mat& v_mat, const arma::mat& l_mat, const arma::mat& m_mat, NumericVector& U_3d);
+RcppExport SEXP _mashr_lik_column_keys_rcpp(SEXP b_matSEXP, SEXP s_matSEXP, SEXP v_matSEXP, SEXP l_matSEXP, SEXP m_matSEXP, SEXP U_3dSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type b_mat(b_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type s_mat(s_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type v_mat(v_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type l_mat(l_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type m_mat(m_matSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type U_3d(U_3dSEXP);
+    rcpp_result_gen = Rcpp::wrap(lik_column_keys_rcpp(b_mat, s_mat, v_mat, l_mat, m_mat, U_3d));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -88,8 +120,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // calc_post_rcpp
-List calc_post_rcpp(const arma::mat& b_mat, const arma::mat& s_mat, const arma::mat& s_alpha_mat, const arma::mat& s_orig_mat, const arma::mat& v_mat, const arma::mat& l_mat, const arma::mat& a_mat, NumericVector& U_3d, const arma::mat& posterior_weights, bool common_cov, int report_type, int n_thread);
-RcppExport SEXP _mashr_calc_post_rcpp(SEXP b_matSEXP, SEXP s_matSEXP, SEXP s_alpha_matSEXP, SEXP s_orig_matSEXP, SEXP v_matSEXP, SEXP l_matSEXP, SEXP a_matSEXP, SEXP U_3dSEXP, SEXP posterior_weightsSEXP, SEXP common_covSEXP, SEXP report_typeSEXP, SEXP n_threadSEXP) {
+List calc_post_rcpp(const arma::mat& b_mat, const arma::mat& s_mat, const arma::mat& s_alpha_mat, const arma::mat& s_orig_mat, const arma::mat& v_mat, const arma::mat& l_mat, const arma::mat& a_mat, const arma::mat& m_mat, NumericVector& U_3d, const arma::mat& posterior_weights, bool common_cov, int report_type, int n_thread);
+RcppExport SEXP _mashr_calc_post_rcpp(SEXP b_matSEXP, SEXP s_matSEXP, SEXP s_alpha_matSEXP, SEXP s_orig_matSEXP, SEXP v_matSEXP, SEXP l_matSEXP, SEXP a_matSEXP, SEXP m_matSEXP, SEXP U_3dSEXP, SEXP posterior_weightsSEXP, SEXP common_covSEXP, SEXP report_typeSEXP, SEXP n_threadSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -100,12 +132,395 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const arma::mat& >::type v_mat(v_matSEXP);
     Rcpp::traits::input_parameter< const arma::mat& >::type l_mat(l_matSEXP);
     Rcpp::traits::input_parameter< const arma::mat& >::type a_mat(a_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type m_mat(m_matSEXP);
     Rcpp::traits::input_parameter< NumericVector& >::type U_3d(U_3dSEXP);
     Rcpp::traits::input_parameter< const arma::mat& >::type posterior_weights(posterior_weightsSEXP);
     Rcpp::traits::input_parameter< bool >::type common_cov(common_covSEXP);
     Rcpp::traits::input_parameter< int >::type report_type(report_typeSEXP);
     Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
-    rcpp_result_gen = Rcpp::wrap(calc_post_rcpp(b_mat, s_mat, s_alpha_mat, s_orig_mat, v_mat, l_mat, a_mat, U_3d, posterior_weights, common_cov, report_type, n_thread));
+    rcpp_result_gen = Rcpp::wrap(calc_post_rcpp(b_mat, s_mat, s_alpha_mat, s_orig_mat, v_mat, l_mat, a_mat, m_mat, U_3d, posterior_weights, common_cov, report_type, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
+// calc_post_samples_rcpp
+List calc_post_samples_rcpp(const arma::mat& b_mat, const arma::mat& s_mat, const arma::mat& s_alpha_mat, const arma::mat& s_orig_mat, const arma::mat& v_mat, const arma::mat& l_mat, const arma::mat& a_mat, const arma::mat& m_mat, NumericVector& U_3d, const arma::mat& posterior_weights, int n_samples, int seed, const arma::vec& probs, double factor, double lfsr_thresh, int fun_type, int n_thread);
+RcppExport SEXP _mashr_calc_post_samples_rcpp(SEXP b_matSEXP, SEXP s_matSEXP, SEXP s_alpha_matSEXP, SEXP s_orig_matSEXP, SEXP v_matSEXP, SEXP l_matSEXP, SEXP a_matSEXP, SEXP m_matSEXP, SEXP U_3dSEXP, SEXP posterior_weightsSEXP, SEXP n_samplesSEXP, SEXP seedSEXP, SEXP probsSEXP, SEXP factorSEXP, SEXP lfsr_threshSEXP, SEXP fun_typeSEXP, SEXP n_threadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type b_mat(b_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type s_mat(s_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type s_alpha_mat(s_alpha_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type s_orig_mat(s_orig_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type v_mat(v_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type l_mat(l_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type a_mat(a_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type m_mat(m_matSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type U_3d(U_3dSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type posterior_weights(posterior_weightsSEXP);
+    Rcpp::traits::input_parameter< int >::type n_samples(n_samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type probs(probsSEXP);
+    Rcpp::traits::input_parameter< double >::type factor(factorSEXP);
+    Rcpp::traits::input_parameter< double >::type lfsr_thresh(lfsr_threshSEXP);
+    Rcpp::traits::input_parameter< int >::type fun_type(fun_typeSEXP);
+    Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
+    rcpp_result_gen = Rcpp::wrap(calc_post_samples_rcpp(b_mat, s_mat, s_alpha_mat, s_orig_mat, v_mat, l_mat, a_mat, m_mat, U_3d, posterior_weights, n_samples, seed, probs, factor, lfsr_thresh, fun_type, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pairwise_sharing_rcpp
+List pairwise_sharing_rcpp(NumericVector& x_3d, const arma::mat& lfsr_mat, double factor, double lfsr_thresh, int fun_type, bool na_rm, int n_thread);
+RcppExport SEXP _mashr_pairwise_sharing_rcpp(SEXP x_3dSEXP, SEXP lfsr_matSEXP, SEXP factorSEXP, SEXP lfsr_threshSEXP, SEXP fun_typeSEXP, SEXP na_rmSEXP, SEXP n_threadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector& >::type x_3d(x_3dSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type lfsr_mat(lfsr_matSEXP);
+    Rcpp::traits::input_parameter< double >::type factor(factorSEXP);
+    Rcpp::traits::input_parameter< double >::type lfsr_thresh(lfsr_threshSEXP);
+    Rcpp::traits::input_parameter< int >::type fun_type(fun_typeSEXP);
+    Rcpp::traits::input_parameter< bool >::type na_rm(na_rmSEXP);
+    Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
+    rcpp_result_gen = Rcpp::wrap(pairwise_sharing_rcpp(x_3d, lfsr_mat, factor, lfsr_thresh, fun_type, na_rm, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
+// fit_mash_batch_rcpp
+List fit_mash_batch_rcpp(const List& problem_list, NumericVector& U_3d, const arma::vec& prior, int maxiter, double tol, double pi_thresh, int n_thread);
+RcppExport SEXP _mashr_fit_mash_batch_rcpp(SEXP problem_listSEXP, SEXP U_3dSEXP, SEXP priorSEXP, SEXP maxiterSEXP, SEXP tolSEXP, SEXP pi_threshSEXP, SEXP n_threadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const List& >::type problem_list(problem_listSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type U_3d(U_3dSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type prior(priorSEXP);
+    Rcpp::traits::input_parameter< int >::type maxiter(maxiterSEXP);
+    Rcpp::traits::input_parameter< double >::type tol(tolSEXP);
+    Rcpp::traits::input_parameter< double >::type pi_thresh(pi_threshSEXP);
+    Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
+    rcpp_result_gen = Rcpp::wrap(fit_mash_batch_rcpp(problem_list, U_3d, prior, maxiter, tol, pi_thresh, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
+// start_server_rcpp
+SEXP start_server_rcpp(const std::string& path);
+RcppExport SEXP _mashr_start_server_rcpp(SEXP pathSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    rcpp_result_gen = Rcpp::wrap(start_server_rcpp(path));
+    return rcpp_result_gen;
+END_RCPP
+}
+// add_server_model_rcpp
+int add_server_model_rcpp(SEXP server, NumericVector& U_3d, const arma::vec& pi, const arma::mat& v_mat, double alpha, double pi_thresh);
+RcppExport SEXP _mashr_add_server_model_rcpp(SEXP serverSEXP, SEXP U_3dSEXP, SEXP piSEXP, SEXP v_matSEXP, SEXP alphaSEXP, SEXP pi_threshSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type server(serverSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type U_3d(U_3dSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type pi(piSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type v_mat(v_matSEXP);
+    Rcpp::traits::input_parameter< double >::type alpha(alphaSEXP);
+    Rcpp::traits::input_parameter< double >::type pi_thresh(pi_threshSEXP);
+    rcpp_result_gen = Rcpp::wrap(add_server_model_rcpp(server, U_3d, pi, v_mat, alpha, pi_thresh));
+    return rcpp_result_gen;
+END_RCPP
+}
+// server_stats_rcpp
+List server_stats_rcpp(SEXP server);
+RcppExport SEXP _mashr_server_stats_rcpp(SEXP serverSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type server(serverSEXP);
+    rcpp_result_gen = Rcpp::wrap(server_stats_rcpp(server));
+    return rcpp_result_gen;
+END_RCPP
+}
+// stop_server_rcpp
+int stop_server_rcpp(SEXP server);
+RcppExport SEXP _mashr_stop_server_rcpp(SEXP serverSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type server(serverSEXP);
+    rcpp_result_gen = Rcpp::wrap(stop_server_rcpp(server));
+    return rcpp_result_gen;
+END_RCPP
+}
+// score_server_rcpp
+List score_server_rcpp(const std::string& path, int model, const arma::mat& b_mat, const arma::mat& s_mat);
+RcppExport SEXP _mashr_score_server_rcpp(SEXP pathSEXP, SEXP modelSEXP, SEXP b_matSEXP, SEXP s_matSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< int >::type model(modelSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type b_mat(b_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type s_mat(s_matSEXP);
+    rcpp_result_gen = Rcpp::wrap(score_server_rcpp(path, model, b_mat, s_mat));
+    return rcpp_result_gen;
+END_RCPP
+}
+// prepare_data_rcpp
+List prepare_data_rcpp(NumericVector& b, NumericVector& s, NumericVector& pval, NumericVector& df, int J, int R, double alpha, double zero_tol, double zero_both_reset, double zero_s_reset, int n_thread);
+RcppExport SEXP _mashr_prepare_data_rcpp(SEXP bSEXP, SEXP sSEXP, SEXP pvalSEXP, SEXP dfSEXP, SEXP JSEXP, SEXP RSEXP, SEXP alphaSEXP, SEXP zero_tolSEXP, SEXP zero_both_resetSEXP, SEXP zero_s_resetSEXP, SEXP n_threadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector& >::type b(bSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type s(sSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type pval(pvalSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type df(dfSEXP);
+    Rcpp::traits::input_parameter< int >::type J(JSEXP);
+    Rcpp::traits::input_parameter< int >::type R(RSEXP);
+    Rcpp::traits::input_parameter< double >::type alpha(alphaSEXP);
+    Rcpp::traits::input_parameter< double >::type zero_tol(zero_tolSEXP);
+    Rcpp::traits::input_parameter< double >::type zero_both_reset(zero_both_resetSEXP);
+    Rcpp::traits::input_parameter< double >::type zero_s_reset(zero_s_resetSEXP);
+    Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
+    rcpp_result_gen = Rcpp::wrap(prepare_data_rcpp(b, s, pval, df, J, R, alpha, zero_tol, zero_both_reset, zero_s_reset, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
+// write_data_rcpp
+List write_data_rcpp(const std::string& path, NumericVector& b, NumericVector& s, NumericVector& pval, NumericVector& df, int J, int R, double alpha, double zero_tol, double zero_both_reset, double zero_s_reset, int n_thread);
+RcppExport SEXP _mashr_write_data_rcpp(SEXP pathSEXP, SEXP bSEXP, SEXP sSEXP, SEXP pvalSEXP, SEXP dfSEXP, SEXP JSEXP, SEXP RSEXP, SEXP alphaSEXP, SEXP zero_tolSEXP, SEXP zero_both_resetSEXP, SEXP zero_s_resetSEXP, SEXP n_threadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type b(bSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type s(sSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type pval(pvalSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type df(dfSEXP);
+    Rcpp::traits::input_parameter< int >::type J(JSEXP);
+    Rcpp::traits::input_parameter< int >::type R(RSEXP);
+    Rcpp::traits::input_parameter< double >::type alpha(alphaSEXP);
+    Rcpp::traits::input_parameter< double >::type zero_tol(zero_tolSEXP);
+    Rcpp::traits::input_parameter< double >::type zero_both_reset(zero_both_resetSEXP);
+    Rcpp::traits::input_parameter< double >::type zero_s_reset(zero_s_resetSEXP);
+    Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
+    rcpp_result_gen = Rcpp::wrap(write_data_rcpp(path, b, s, pval, df, J, R, alpha, zero_tol, zero_both_reset, zero_s_reset, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
+// read_data_rcpp
+List read_data_rcpp(const std::string& path, double start, double n);
+RcppExport SEXP _mashr_read_data_rcpp(SEXP pathSEXP, SEXP startSEXP, SEXP nSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< double >::type start(startSEXP);
+    Rcpp::traits::input_parameter< double >::type n(nSEXP);
+    rcpp_result_gen = Rcpp::wrap(read_data_rcpp(path, start, n));
+    return rcpp_result_gen;
+END_RCPP
+}
+// udi_cov_rcpp
+arma::cube udi_cov_rcpp(const arma::mat& v_mat, const arma::imat& models, int n_thread);
+RcppExport SEXP _mashr_udi_cov_rcpp(SEXP v_matSEXP, SEXP modelsSEXP, SEXP n_threadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type v_mat(v_matSEXP);
+    Rcpp::traits::input_parameter< const arma::imat& >::type models(modelsSEXP);
+    Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
+    rcpp_result_gen = Rcpp::wrap(udi_cov_rcpp(v_mat, models, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
+// udi_select_rcpp
+List udi_select_rcpp(const arma::mat& b_mat, const arma::mat& s_mat, const arma::mat& v_mat, const arma::imat& models, const arma::vec& grid, const arma::uvec& screen, int n_top, int n_rescore, int n_thread);
+RcppExport SEXP _mashr_udi_select_rcpp(SEXP b_matSEXP, SEXP s_matSEXP, SEXP v_matSEXP, SEXP modelsSEXP, SEXP gridSEXP, SEXP screenSEXP, SEXP n_topSEXP, SEXP n_rescoreSEXP, SEXP n_threadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type b_mat(b_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type s_mat(s_matSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type v_mat(v_matSEXP);
+    Rcpp::traits::input_parameter< const arma::imat& >::type models(modelsSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type grid(gridSEXP);
+    Rcpp::traits::input_parameter< const arma::uvec& >::type screen(screenSEXP);
+    Rcpp::traits::input_parameter< int >::type n_top(n_topSEXP);
+    Rcpp::traits::input_parameter< int >::type n_rescore(n_rescoreSEXP);
+    Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
+    rcpp_result_gen = Rcpp::wrap(udi_select_rcpp(b_mat, s_mat, v_mat, models, grid, screen, n_top, n_rescore, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
+// rsvd_rcpp
+List rsvd_rcpp(const arma::mat& x_mat, const arma::uvec& rows, int k, int n_over, int n_power, int seed, int n_thread);
+RcppExport SEXP _mashr_rsvd_rcpp(SEXP x_matSEXP, SEXP rowsSEXP, SEXP kSEXP, SEXP n_overSEXP, SEXP n_powerSEXP, SEXP seedSEXP, SEXP n_threadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type x_mat(x_matSEXP);
+    Rcpp::traits::input_parameter< const arma::uvec& >::type rows(rowsSEXP);
+    Rcpp::traits::input_parameter< int >::type k(kSEXP);
+    Rcpp::traits::input_parameter< int >::type n_over(n_overSEXP);
+    Rcpp::traits::input_parameter< int >::type n_power(n_powerSEXP);
+    Rcpp::traits::input_parameter< int >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
+    rcpp_result_gen = Rcpp::wrap(rsvd_rcpp(x_mat, rows, k, n_over, n_power, seed, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bootstrap_pi_rcpp
+List bootstrap_pi_rcpp(const arma::mat& lik_mat, const arma::vec& offset, const arma::vec& prior, const arma::vec& pi_init, int B, int seed, int maxiter, double tol, int n_thread);
+RcppExport SEXP _mashr_bootstrap_pi_rcpp(SEXP lik_matSEXP, SEXP offsetSEXP, SEXP priorSEXP, SEXP pi_initSEXP, SEXP BSEXP, SEXP seedSEXP, SEXP maxiterSEXP, SEXP tolSEXP, SEXP n_threadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type lik_mat(lik_matSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type offset(offsetSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type prior(priorSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type pi_init(pi_initSEXP);
+    Rcpp::traits::input_parameter< int >::type B(BSEXP);
+    Rcpp::traits::input_parameter< int >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< int >::type maxiter(maxiterSEXP);
+    Rcpp::traits::input_parameter< double >::type tol(tolSEXP);
+    Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
+    rcpp_result_gen = Rcpp::wrap(bootstrap_pi_rcpp(lik_mat, offset, prior, pi_init, B, seed, maxiter, tol, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
+// run_pipeline_rcpp
+List run_pipeline_rcpp(const std::string& in_path, const std::string& out_path, NumericVector& U_3d, const arma::vec& pi, const arma::mat& v_mat, double pi_thresh, double chunk_size, int n_workers, double depth, SEXP compact);
+RcppExport SEXP _mashr_run_pipeline_rcpp(SEXP in_pathSEXP, SEXP out_pathSEXP, SEXP U_3dSEXP, SEXP piSEXP, SEXP v_matSEXP, SEXP pi_threshSEXP, SEXP chunk_sizeSEXP, SEXP n_workersSEXP, SEXP depthSEXP, SEXP compactSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type in_path(in_pathSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type out_path(out_pathSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type U_3d(U_3dSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type pi(piSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type v_mat(v_matSEXP);
+    Rcpp::traits::input_parameter< double >::type pi_thresh(pi_threshSEXP);
+    Rcpp::traits::input_parameter< double >::type chunk_size(chunk_sizeSEXP);
+    Rcpp::traits::input_parameter< int >::type n_workers(n_workersSEXP);
+    Rcpp::traits::input_parameter< double >::type depth(depthSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type compact(compactSEXP);
+    rcpp_result_gen = Rcpp::wrap(run_pipeline_rcpp(in_path, out_path, U_3d, pi, v_mat, pi_thresh, chunk_size, n_workers, depth, compact));
+    return rcpp_result_gen;
+END_RCPP
+}
+// read_results_rcpp
+List read_results_rcpp(const std::string& path, double start, double n);
+RcppExport SEXP _mashr_read_results_rcpp(SEXP pathSEXP, SEXP startSEXP, SEXP nSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< double >::type start(startSEXP);
+    Rcpp::traits::input_parameter< double >::type n(nSEXP);
+    rcpp_result_gen = Rcpp::wrap(read_results_rcpp(path, start, n));
+    return rcpp_result_gen;
+END_RCPP
+}
+// write_compact_rcpp
+void write_compact_rcpp(const std::string& path, const arma::mat& post_mean, const arma::mat& post_sd, const arma::mat& lfsr, const arma::mat& neg_prob, const arma::mat& lfdr, const arma::vec& loglik, const std::vector<std::string>& names, List compact);
+RcppExport SEXP _mashr_write_compact_rcpp(SEXP pathSEXP, SEXP post_meanSEXP, SEXP post_sdSEXP, SEXP lfsrSEXP, SEXP neg_probSEXP, SEXP lfdrSEXP, SEXP loglikSEXP, SEXP namesSEXP, SEXP compactSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type post_mean(post_meanSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type post_sd(post_sdSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type lfsr(lfsrSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type neg_prob(neg_probSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type lfdr(lfdrSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type loglik(loglikSEXP);
+    Rcpp::traits::input_parameter< const std::vector<std::string>& >::type names(namesSEXP);
+    Rcpp::traits::input_parameter< List >::type compact(compactSEXP);
+    write_compact_rcpp(path, post_mean, post_sd, lfsr, neg_prob, lfdr, loglik, names, compact);
+    return R_NilValue;
+END_RCPP
+}
+// compact_info_rcpp
+List compact_info_rcpp(const std::string& path);
+RcppExport SEXP _mashr_compact_info_rcpp(SEXP pathSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    rcpp_result_gen = Rcpp::wrap(compact_info_rcpp(path));
+    return rcpp_result_gen;
+END_RCPP
+}
+// compact_find_rcpp
+NumericVector compact_find_rcpp(const std::string& path, const std::vector<std::string>& names);
+RcppExport SEXP _mashr_compact_find_rcpp(SEXP pathSEXP, SEXP namesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< const std::vector<std::string>& >::type names(namesSEXP);
+    rcpp_result_gen = Rcpp::wrap(compact_find_rcpp(path, names));
+    return rcpp_result_gen;
+END_RCPP
+}
+// read_compact_rcpp
+List read_compact_rcpp(const std::string& path, const arma::uvec& effects, const arma::uvec& conds);
+RcppExport SEXP _mashr_read_compact_rcpp(SEXP pathSEXP, SEXP effectsSEXP, SEXP condsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< const arma::uvec& >::type effects(effectsSEXP);
+    Rcpp::traits::input_parameter< const arma::uvec& >::type conds(condsSEXP);
+    rcpp_result_gen = Rcpp::wrap(read_compact_rcpp(path, effects, conds));
+    return rcpp_result_gen;
+END_RCPP
+}
+// numa_report_rcpp
+List numa_report_rcpp();
+RcppExport SEXP _mashr_numa_report_rcpp() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    rcpp_result_gen = Rcpp::wrap(numa_report_rcpp());
+    return rcpp_result_gen;
+END_RCPP
+}
+// calc_mvser_rcpp
+List calc_mvser_rcpp(SEXP x, const arma::mat& y_mat, const arma::vec& center, const arma::vec& scale, const arma::vec& xtx, const arma::mat& resid_var, NumericVector& U_3d, NumericVector& Uinv_3d, const arma::vec& pi, const arma::vec& prior_weights, int n_thread);
+RcppExport SEXP _mashr_calc_mvser_rcpp(SEXP xSEXP, SEXP y_matSEXP, SEXP centerSEXP, SEXP scaleSEXP, SEXP xtxSEXP, SEXP resid_varSEXP, SEXP U_3dSEXP, SEXP Uinv_3dSEXP, SEXP piSEXP, SEXP prior_weightsSEXP, SEXP n_threadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type x(xSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type y_mat(y_matSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type center(centerSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type scale(scaleSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type xtx(xtxSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type resid_var(resid_varSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type U_3d(U_3dSEXP);
+    Rcpp::traits::input_parameter< NumericVector& >::type Uinv_3d(Uinv_3dSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type pi(piSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type prior_weights(prior_weightsSEXP);
+    Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
+    rcpp_result_gen = Rcpp::wrap(calc_mvser_rcpp(x, y_mat, center, scale, xtx, resid_var, U_3d, Uinv_3d, pi, prior_weights, n_thread));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kmeans_init_rcpp
+List kmeans_init_rcpp(const arma::mat& x_mat, int K, const arma::mat& noise, double eigen_floor, int seed, int n_thread);
+RcppExport SEXP _mashr_kmeans_init_rcpp(SEXP x_matSEXP, SEXP KSEXP, SEXP noiseSEXP, SEXP eigen_floorSEXP, SEXP seedSEXP, SEXP n_threadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type x_mat(x_matSEXP);
+    Rcpp::traits::input_parameter< int >::type K(KSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type noise(noiseSEXP);
+    Rcpp::traits::input_parameter< double >::type eigen_floor(eigen_floorSEXP);
+    Rcpp::traits::input_parameter< int >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< int >::type n_thread(n_threadSEXP);
+    rcpp_result_gen = Rcpp::wrap(kmeans_init_rcpp(x_mat, K, noise, eigen_floor, seed, n_thread));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -151,9 +566,35 @@ END_RCPP
 static const R_CallMethodDef CallEntries[] = {
     {"_mashr_extreme_deconvolution_rcpp", (DL_FUNC) &_mashr_extreme_deconvolution_rcpp, 20},
     {"_mashr_inv_chol_tri_rcpp", (DL_FUNC) &_mashr_inv_chol_tri_rcpp, 1},
-    {"_mashr_calc_lik_rcpp", (DL_FUNC) &_mashr_calc_lik_rcpp, 9},
+    {"_mashr_precompute_factors_rcpp", (DL_FUNC) &_mashr_precompute_factors_rcpp, 5},
+    {"_mashr_calc_lik_rcpp", (DL_FUNC) &_mashr_calc_lik_rcpp, 10},
+    {"_mashr_lik_column_keys_rcpp", (DL_FUNC) &_mashr_lik_column_keys_rcpp, 6},
     {"_mashr_calc_lik_precomputed_rcpp", (DL_FUNC) &_mashr_calc_lik_precomputed_rcpp, 5},
-    {"_mashr_calc_post_rcpp", (DL_FUNC) &_mashr_calc_post_rcpp, 12},
+    {"_mashr_calc_post_rcpp", (DL_FUNC) &_mashr_calc_post_rcpp, 13},
+    {"_mashr_calc_post_samples_rcpp", (DL_FUNC) &_mashr_calc_post_samples_rcpp, 17},
+    {"_mashr_pairwise_sharing_rcpp", (DL_FUNC) &_mashr_pairwise_sharing_rcpp, 7},
+    {"_mashr_fit_mash_batch_rcpp", (DL_FUNC) &_mashr_fit_mash_batch_rcpp, 7},
+    {"_mashr_start_server_rcpp", (DL_FUNC) &_mashr_start_server_rcpp, 1},
+    {"_mashr_add_server_model_rcpp", (DL_FUNC) &_mashr_add_server_model_rcpp, 6},
+    {"_mashr_server_stats_rcpp", (DL_FUNC) &_mashr_server_stats_rcpp, 1},
+    {"_mashr_stop_server_rcpp", (DL_FUNC) &_mashr_stop_server_rcpp, 1},
+    {"_mashr_score_server_rcpp", (DL_FUNC) &_mashr_score_server_rcpp, 4},
+    {"_mashr_prepare_data_rcpp", (DL_FUNC) &_mashr_prepare_data_rcpp, 11},
+    {"_mashr_write_data_rcpp", (DL_FUNC) &_mashr_write_data_rcpp, 12},
+    {"_mashr_read_data_rcpp", (DL_FUNC) &_mashr_read_data_rcpp, 3},
+    {"_mashr_udi_cov_rcpp", (DL_FUNC) &_mashr_udi_cov_rcpp, 3},
+    {"_mashr_udi_select_rcpp", (DL_FUNC) &_mashr_udi_select_rcpp, 9},
+    {"_mashr_rsvd_rcpp", (DL_FUNC) &_mashr_rsvd_rcpp, 7},
+    {"_mashr_bootstrap_pi_rcpp", (DL_FUNC) &_mashr_bootstrap_pi_rcpp, 9},
+    {"_mashr_run_pipeline_rcpp", (DL_FUNC) &_mashr_run_pipeline_rcpp, 10},
+    {"_mashr_read_results_rcpp", (DL_FUNC) &_mashr_read_results_rcpp, 3},
+    {"_mashr_write_compact_rcpp", (DL_FUNC) &_mashr_write_compact_rcpp, 9},
+    {"_mashr_compact_info_rcpp", (DL_FUNC) &_mashr_compact_info_rcpp, 1},
+    {"_mashr_compact_find_rcpp", (DL_FUNC) &_mashr_compact_find_rcpp, 2},
+    {"_mashr_read_compact_rcpp", (DL_FUNC) &_mashr_read_compact_rcpp, 3},
+    {"_mashr_numa_report_rcpp", (DL_FUNC) &_mashr_numa_report_rcpp, 0},
+    {"_mashr_calc_mvser_rcpp", (DL_FUNC) &_mashr_calc_mvser_rcpp, 11},
+    {"_mashr_kmeans_init_rcpp", (DL_FUNC) &_mashr_kmeans_init_rcpp, 6},
     {"_mashr_calc_sermix_rcpp", (DL_FUNC) &_mashr_calc_sermix_rcpp, 11},
     {"_mashr_fit_teem_rcpp", (DL_FUNC) &_mashr_fit_teem_rcpp, 7},
     {NULL, NULL, 0}
@@ -11,8 +11,11 @@
 #ifdef _OPENMP
 # include <omp.h>
 #endif
+#include "progress.h"
 
 #define CHUNKSIZE 1
+#define CACHELINE_DOUBLES 8 /* doubles in a 64 byte cache line */
+#define POINTBLOCK 8        /* points in the smallest block of proj_EM_step */
 
 // GLOBAL VARIABLES
 // ----------------
@@ -54,6 +57,13 @@ struct modelbs {
 
 struct modelbs * bs = NULL;
 
+/* storage of the accumulators of each thread, see alloc_thread_accumulators */
+gsl_block ** threadblocks = NULL;
+
+/* the data points of block b of proj_EM_step are pointblocks[b] to pointblocks[b + 1] - 1 */
+int * pointblocks = NULL;
+int npointblocks  = 0;
+
 FILE * logfile     = NULL;
 FILE * convlogfile = NULL;
 
@@ -107,6 +117,12 @@ proj_gauss_mixtures(struct datapoint * data, int N, struct gaussian * gaussians,
                     bool diagerrs, bool noweight);
 void
 calc_qstarij(double * qstarij, gsl_matrix * qij, int partial_indx[3]);
+void
+alloc_thread_accumulators(int K, int d);
+void
+free_thread_accumulators(int K);
+void
+make_point_blocks(struct datapoint * data, int N, int d);
 
 // FUNCTION DEFINITIONS
 // --------------------
@@ -571,9 +587,10 @@ proj_EM(struct datapoint * data, int N, struct gaussian * gaussians,
 	int d     = (gaussians->mm)->size;
 
 	halflogtwopi = 0.5 * log(8. * atan(1.0));
-	while (diff > tol && niter < maxiter) {
+	while (diff > tol && niter < maxiter && !progress_cancelled()) {
 		proj_EM_step(data, N, gaussians, K, fixamp, fixmean, fixcovar, avgloglikedata,
 		             likeonly, w, noproj, diagerrs, noweight);
+		progress_tick();
 		if (keeplog) {
 			fprintf(logfile, "%f\n", *avgloglikedata);
 			fprintf(tmplogfile, "%f\n", *avgloglikedata);
@@ -686,14 +703,20 @@ proj_EM_step(struct datapoint * data, int N,
 	fixcovar  -= K;
 
 	// now loop over data and gaussians to update the model parameters
-	int ii, jj, ll;
+	// each task is a block of consecutive points, of about equal cost
+	// whatever their dimensions (see make_point_blocks), so that threads
+	// write distinct cache lines of qij and share out uneven work
+	int ii, jj, ll, bb;
 	double sumSV;
+	double loglikedata = 0.0;
 	int chunk;
 	chunk = CHUNKSIZE;
-    #pragma omp parallel for schedule(static,chunk) \
+    #pragma omp parallel for schedule(dynamic,1) \
 	private(tid,di,signum,exponent,ii,jj,ll,kk,Tij,Tij_inv,wminusRm,p,VRTTinv,sumSV,VRT,TinvwminusRm,Rtrans,thisgaussian,thisdata,thisbs,thisnewgaussian,currqij) \
-	shared(newgaussians,gaussians,bs,allfixed,K,d,data,avgloglikedata)
-	for (ii = 0; ii < N; ++ii) {
+	shared(newgaussians,gaussians,bs,allfixed,K,d,data,pointblocks,npointblocks) \
+	reduction(+:loglikedata)
+	for (bb = 0; bb < npointblocks; ++bb)
+	for (ii = pointblocks[bb]; ii < pointblocks[bb + 1]; ++ii) {
 		thisdata = data + ii;
 	#ifdef _OPENMP
 		tid = omp_get_thread_num();
@@ -785,11 +808,8 @@ proj_EM_step(struct datapoint * data, int N,
 		gsl_matrix_free(VRTTinv);
 		if (!noproj) gsl_matrix_free(Rtrans);
 		// Again loop over the gaussians to update the model(can this be more efficient? in any case this is not so bad since generally K << N)
-	#pragma omp critical
-		{
-			// Normalize qij properly
-			*avgloglikedata += normalize_row(qij, ii, true, noweight, thisdata->logweight);
-		}
+		// Normalize qij properly
+		loglikedata += normalize_row(qij, ii, true, noweight, thisdata->logweight);
 		for (jj = 0; jj != K; ++jj) {
 			currqij = exp(gsl_matrix_get(qij, ii, jj));
 			thisbs = bs + tid * K + jj;
@@ -800,7 +820,7 @@ proj_EM_step(struct datapoint * data, int N,
 			gsl_matrix_add(thisnewgaussian->VV, thisbs->BBij);
 		}
 	}
-	*avgloglikedata /= N;
+	*avgloglikedata = loglikedata / N;
 	if (likeonly) {
 		free(allfixed);
 		return;
@@ -879,6 +899,129 @@ proj_EM_step(struct datapoint * data, int N,
 	free(allfixed);
 } // proj_EM_step
 
+/*
+ * NAME:
+ *   alloc_thread_accumulators
+ * PURPOSE:
+ *   allocates the bs and newgaussians accumulators of each thread
+ * CALLING SEQUENCE:
+ *   alloc_thread_accumulators(int K, int d)
+ * INPUT:
+ *   K - number of model gaussians
+ *   d - dimension of the gaussians
+ * OUTPUT:
+ *   bs, newgaussians and startnewgaussians; the accumulators of thread t
+ *   for gaussian j are bs[t * K + j] and newgaussians[t * K + j]
+ * COMMENT:
+ *   Allocated one by one, the small vectors and matrices of different
+ *   threads sat next to each other on the heap and shared cache lines,
+ *   so the threads' writes invalidated each other's caches. Here those
+ *   of a thread all lie in one block of its own, with a cache line of
+ *   padding at both ends.
+ */
+
+void
+alloc_thread_accumulators(int K, int d)
+{
+	int tt, kk;
+	size_t offset;
+	size_t perthread = (size_t) 2 * K * (d + d * d) + 2 * CACHELINE_DOUBLES;
+	threadblocks      = (gsl_block **) malloc(nthreads * sizeof(gsl_block *) );
+	newgaussians      = (struct gaussian *) malloc(K * nthreads * sizeof(struct gaussian) );
+	startnewgaussians = newgaussians;
+	bs = (struct modelbs *) malloc(nthreads * K * sizeof(struct modelbs) );
+	for (tt = 0; tt != nthreads; ++tt) {
+		threadblocks[tt] = gsl_block_calloc(perthread);
+		offset = CACHELINE_DOUBLES;
+		for (kk = 0; kk != K; ++kk) {
+			newgaussians->alpha = 0.0;
+			newgaussians->mm    = gsl_vector_alloc_from_block(threadblocks[tt], offset, d, 1);
+			offset += d;
+			newgaussians->VV    = gsl_matrix_alloc_from_block(threadblocks[tt], offset, d, d, d);
+			offset += d * d;
+			bs->bbij = gsl_vector_alloc_from_block(threadblocks[tt], offset, d, 1);
+			offset  += d;
+			bs->BBij = gsl_matrix_alloc_from_block(threadblocks[tt], offset, d, d, d);
+			offset  += d * d;
+			++newgaussians;
+			++bs;
+		}
+	}
+	newgaussians = startnewgaussians;
+	bs -= nthreads * K;
+}
+
+void
+free_thread_accumulators(int K)
+{
+	int kk;
+	// the vectors and matrices do not own their storage
+	for (kk = 0; kk != nthreads * K; ++kk) {
+		gsl_vector_free(bs->bbij);
+		gsl_matrix_free(bs->BBij);
+		gsl_vector_free(newgaussians->mm);
+		gsl_matrix_free(newgaussians->VV);
+		++bs;
+		++newgaussians;
+	}
+	bs -= nthreads * K;
+	free(bs);
+	newgaussians = startnewgaussians;
+	free(newgaussians);
+	for (kk = 0; kk != nthreads; ++kk)
+		gsl_block_free(threadblocks[kk]);
+	free(threadblocks);
+}
+
+/*
+ * NAME:
+ *   make_point_blocks
+ * PURPOSE:
+ *   splits the data points into blocks of consecutive points for
+ *   proj_EM_step
+ * CALLING SEQUENCE:
+ *   make_point_blocks(struct datapoint * data, int N, int d)
+ * INPUT:
+ *   data - the data
+ *   N    - number of data points
+ *   d    - dimension of the gaussians
+ * OUTPUT:
+ *   pointblocks and npointblocks
+ * COMMENT:
+ *   The work on a point of dimension di is dominated by the LU
+ *   decomposition of Tij and the products with VRT, so it costs about
+ *   di^2 (di + d). Blocks are cut at multiples of POINTBLOCK points once
+ *   they hold a share of the total cost that gives each thread about
+ *   eight blocks to balance with a dynamic schedule. POINTBLOCK rows of
+ *   qij fill K whole cache lines, so, up to the alignment of qij, the
+ *   threads write rows of qij on cache lines of their own.
+ */
+
+void
+make_point_blocks(struct datapoint * data, int N, int d)
+{
+	int ii;
+	double di, cost, total = 0.0;
+	for (ii = 0; ii != N; ++ii) {
+		di     = (double) ((data + ii)->SS)->size1;
+		total += di * di * (di + d);
+	}
+	double target = total / (8.0 * nthreads);
+	pointblocks  = (int *) malloc((N / POINTBLOCK + 2) * sizeof(int) );
+	npointblocks = 0;
+	pointblocks[0] = 0;
+	cost = 0.0;
+	for (ii = 0; ii != N; ++ii) {
+		di    = (double) ((data + ii)->SS)->size1;
+		cost += di * di * (di + d);
+		if ((ii + 1) % POINTBLOCK == 0 && cost >= target && ii + 1 < N) {
+			pointblocks[++npointblocks] = ii + 1;
+			cost = 0.0;
+		}
+	}
+	pointblocks[++npointblocks] = N;
+}
+
 /*
  * NAME:
  *   proj_gauss_mixtures
@@ -954,16 +1097,9 @@ proj_gauss_mixtures(struct datapoint * data, int N,
     #else
 	nthreads = 1;
     #endif
-	newgaussians      = (struct gaussian *) malloc(K * nthreads * sizeof(struct gaussian) );
-	startnewgaussians = newgaussians;
 	int ll;
-	for (kk = 0; kk != K * nthreads; ++kk) {
-		newgaussians->alpha = 0.0;
-		newgaussians->mm    = gsl_vector_calloc(d);
-		newgaussians->VV    = gsl_matrix_calloc(d, d);
-		++newgaussians;
-	}
-	newgaussians = startnewgaussians;
+	alloc_thread_accumulators(K, d);
+	make_point_blocks(data, N, d);
 	double oldavgloglikedata;
 	// allocate the q_ij matrix
 	qij = gsl_matrix_alloc(N, K);
@@ -971,14 +1107,6 @@ proj_gauss_mixtures(struct datapoint * data, int N,
 	I = gsl_matrix_alloc(d, d);
 	gsl_matrix_set_identity(I);// Unit matrix
 	gsl_matrix_scale(I, w);// scaled to w
-	// Also take care of the bbij's and the BBij's
-	bs = (struct modelbs *) malloc(nthreads * K * sizeof(struct modelbs) );
-	for (kk = 0; kk != nthreads * K; ++kk) {
-		bs->bbij = gsl_vector_alloc(d);
-		bs->BBij = gsl_matrix_alloc(d, d);
-		++bs;
-	}
-	bs -= nthreads * K;
 	// splitnmerge
 	int maxsnm = K * (K - 1) * (K - 2) / 2;
 	int * snmhierarchy = (int *) malloc(maxsnm * 3 * sizeof(int) );
@@ -1171,20 +1299,9 @@ proj_gauss_mixtures(struct datapoint * data, int N,
 	// Free memory
 	gsl_matrix_free(I);
 	gsl_matrix_free(qij);
-	for (kk = 0; kk != nthreads * K; ++kk) {
-		gsl_vector_free(bs->bbij);
-		gsl_matrix_free(bs->BBij);
-		++bs;
-	}
-	bs -= nthreads * K;
-	free(bs);
-	for (kk = 0; kk != K * nthreads; ++kk) {
-		gsl_vector_free(newgaussians->mm);
-		gsl_matrix_free(newgaussians->VV);
-		++newgaussians;
-	}
-	newgaussians = startnewgaussians;
-	free(newgaussians);
+	free_thread_accumulators(K);
+	free(pointblocks);
+	pointblocks = NULL;
 	gsl_rng_free(randgen);
 
 	gsl_matrix_free(oldqij);
@@ -1484,10 +1601,23 @@ extreme_deconvolution_rcpp(
 	double * avgloglikedata;
 	avgloglikedata = &avgloglikedata_np;
 
-	// Then run projected_gauss_mixtures
-	proj_gauss_mixtures(data, N, gaussians, K, fixamp, fixmean, fixcovar,
-	                    avgloglikedata, tol, (long long int) maxiter, (bool) likeonly, w,
-	                    splitnmerge, keeplog, logfile, convlogfile, noproj, diagerrs, noweight);
+	// Then run projected_gauss_mixtures, counting EM steps as progress; on
+	// a user interrupt the EM stops early and memory is released below
+	// before the interrupt is passed on
+	int n_thread = 1;
+    #ifdef _OPENMP
+	n_thread = omp_get_max_threads();
+    #endif
+	bool interrupted = false;
+	try {
+		run_monitored("extreme_deconvolution", n_thread, [&]() {
+			proj_gauss_mixtures(data, N, gaussians, K, fixamp, fixmean, fixcovar,
+			                    avgloglikedata, tol, (long long int) maxiter, (bool) likeonly, w,
+			                    splitnmerge, keeplog, logfile, convlogfile, noproj, diagerrs, noweight);
+		});
+	} catch (Rcpp::internal::InterruptedException &) {
+		interrupted = true;
+	}
 
 	// Print the final model parameters to the logfile
 	if (keeplog) {
@@ -1553,6 +1683,7 @@ extreme_deconvolution_rcpp(
 		fclose(logfile);
 		fclose(convlogfile);
 	}
+	if (interrupted) throw Rcpp::internal::InterruptedException();
 
 	return List::create(Named("xmean") = xmean,
 	                    Named("xcovar")         = xcovar,
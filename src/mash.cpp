@@ -1,12 +1,17 @@
 // Wrapper to various C++ functions/objects for inference in MASH
 // Gao Wang (c) 2017-2020 wang.gao@columbia.edu
+#include <cstdio>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #ifdef _OPENMP
 # include <omp.h>
 #endif
 #include "RcppArmadillo.h"
 #include "mash.h"
+#include "mash_server.h"
+#include "mash_io.h"
+#include "mash_pipeline.h"
 
 using Rcpp::List;
 using Rcpp::Named;
@@ -14,6 +19,7 @@ using Rcpp::NumericVector;
 using Rcpp::IntegerVector;
 
 using arma::vectorise;
+using arma::uvec;
 
 // [[Rcpp::plugins(openmp)]]
 // [[Rcpp::plugins(cpp11)]]
@@ -28,12 +34,47 @@ inv_chol_tri_rcpp(const arma::mat & x_mat)
 	                    Named("status") = 0);
 }
 
+// [[Rcpp::export]]
+List
+precompute_factors_rcpp(const arma::mat & s_mat,
+                        const arma::mat & v_mat,
+                        NumericVector  &  U_3d,
+                        bool              common_cov,
+                        int               n_thread = 1)
+{
+	if (Rf_isNull(U_3d.attr("dim"))) {
+		throw std::invalid_argument(
+			      "U_3d has to be a 3D array");
+	}
+	IntegerVector dimU = U_3d.attr("dim");
+	cube U_cube(U_3d.begin(), dimU[0], dimU[1], dimU[2], false, true, false);
+	cube vinv_cube, rooti_cube, U0_cube, Uinv_cube;
+	uvec vinv_status, rooti_status, U0_status, Uinv_status;
+	#ifdef _OPENMP
+	omp_set_num_threads(n_thread);
+	#endif
+	int n_failed = precompute_factors(s_mat, v_mat, U_cube, common_cov,
+	                                  vinv_cube, rooti_cube, U0_cube, Uinv_cube,
+	                                  vinv_status, rooti_status, U0_status,
+	                                  Uinv_status);
+	return List::create(Named("vinv_3d")      = vinv_cube,
+	                    Named("rooti_3d")     = rooti_cube,
+	                    Named("U0_3d")        = U0_cube,
+	                    Named("Uinv_3d")      = Uinv_cube,
+	                    Named("vinv_status")  = vinv_status,
+	                    Named("rooti_status") = rooti_status,
+	                    Named("U0_status")    = U0_status,
+	                    Named("Uinv_status")  = Uinv_status,
+	                    Named("status")       = n_failed);
+} // precompute_factors_rcpp
+
 // [[Rcpp::export]]
 List
 calc_lik_rcpp(const arma::mat & b_mat,
               const arma::mat & s_mat,
               const arma::mat & v_mat,
               const arma::mat & l_mat,
+              const arma::mat & m_mat,
               NumericVector  &   U_3d,
               NumericVector  &   sigma_3d,
               bool              logd,
@@ -42,6 +83,7 @@ calc_lik_rcpp(const arma::mat & b_mat,
 {
 	// hide armadillo warning / error messages
 	mat res;
+	unsigned long long fallbacks = dmvnorm_fallbacks();
 	if (!Rf_isNull(U_3d.attr("dim"))) {
 		// matrix version
 		// set cube data from R 3D array
@@ -53,15 +95,53 @@ calc_lik_rcpp(const arma::mat & b_mat,
 			cube tmp_cube(sigma_3d.begin(), dimSigma[0], dimSigma[1], dimSigma[2], false, true, false);
 			sigma_cube = tmp_cube;
 		}
-		res = calc_lik(b_mat, s_mat, v_mat, l_mat, U_cube, sigma_cube, logd, common_cov, n_thread);
+		run_monitored("calc_lik", n_thread, [&]() {
+			// the effects are split between the threads unless common_cov
+			mat b_local, s_local;
+			bool spread = !common_cov && numa_n_nodes() > 1;
+			if (spread) {
+				numa_copy(b_mat, b_local);
+				numa_copy(s_mat, s_local);
+			}
+			res = calc_lik(spread ? b_local : b_mat, spread ? s_local : s_mat, v_mat,
+			               l_mat, m_mat, U_cube, sigma_cube, logd, common_cov, n_thread);
+		});
 	} else {
 		// vector version
 		res = calc_lik(vectorise(b_mat), vectorise(s_mat), v_mat(0, 0), Rcpp::as<arma::vec>(U_3d), logd);
 	}
-	return List::create(Named("data") = res,
-	                    Named("status") = 0);
+	return List::create(Named("data")      = res,
+	                    Named("status")    = 0,
+	                    Named("fallbacks") = (double) (dmvnorm_fallbacks() - fallbacks));
 } // calc_lik_rcpp
 
+// Keys of the likelihood columns for each prior covariance: a hash of the
+// data the likelihood depends on, followed by a hash of the covariance
+// [[Rcpp::export]]
+Rcpp::CharacterVector
+lik_column_keys_rcpp(const arma::mat & b_mat,
+                     const arma::mat & s_mat,
+                     const arma::mat & v_mat,
+                     const arma::mat & l_mat,
+                     const arma::mat & m_mat,
+                     NumericVector   &  U_3d)
+{
+	IntegerVector dimU = U_3d.attr("dim");
+	cube U_cube(U_3d.begin(), dimU[0], dimU[1], dimU[2], false, true, false);
+	unsigned long long h = hash_mat(b_mat);
+	h = hash_mat(s_mat, h);
+	h = hash_mat(v_mat, h);
+	h = hash_mat(l_mat, h);
+	h = hash_mat(m_mat, h);
+	Rcpp::CharacterVector keys(U_cube.n_slices);
+	char buf[40];
+	for (uword p = 0; p < U_cube.n_slices; ++p) {
+		std::snprintf(buf, sizeof(buf), "%016llx%016llx", h, hash_mat(U_cube.slice(p)));
+		keys[p] = buf;
+	}
+	return keys;
+}
+
 // [[Rcpp::export]]
 List
 calc_lik_precomputed_rcpp(const arma::mat & b_mat,
@@ -90,6 +170,7 @@ calc_post_rcpp(const arma::mat & b_mat,
                const arma::mat & v_mat,
                const arma::mat & l_mat,
                const arma::mat & a_mat,
+               const arma::mat & m_mat,
                NumericVector   &  U_3d,
                const arma::mat & posterior_weights,
                bool              common_cov,
@@ -103,9 +184,11 @@ calc_post_rcpp(const arma::mat & b_mat,
 		IntegerVector dimU = U_3d.attr("dim");
 		cube U_cube(U_3d.begin(), dimU[0], dimU[1], dimU[2], false, true, false);
 		PosteriorMASH pc(b_mat, s_mat, s_alpha_mat, s_orig_mat, v_mat, l_mat, a_mat, U_cube);
-		pc.set_thread(n_thread);
-		if (!common_cov) pc.compute_posterior(posterior_weights, report_type);
-		else pc.compute_posterior_comcov(posterior_weights, report_type);
+		if (!m_mat.is_empty()) pc.set_missing(m_mat);
+		run_monitored("compute_posterior", n_thread, [&]() {
+			if (!common_cov) pc.compute_posterior(posterior_weights, report_type);
+			else pc.compute_posterior_comcov(posterior_weights, report_type);
+		});
 		return List::create(
 			Named("post_mean") = pc.PosteriorMean(),
 			Named("post_sd")   = pc.PosteriorSD(),
@@ -130,6 +213,697 @@ calc_post_rcpp(const arma::mat & b_mat,
 	}
 } // calc_post_rcpp
 
+// Draws posterior samples for each effect and returns only their summaries
+// [[Rcpp::export]]
+List
+calc_post_samples_rcpp(const arma::mat & b_mat,
+                       const arma::mat & s_mat,
+                       const arma::mat & s_alpha_mat,
+                       const arma::mat & s_orig_mat,
+                       const arma::mat & v_mat,
+                       const arma::mat & l_mat,
+                       const arma::mat & a_mat,
+                       const arma::mat & m_mat,
+                       NumericVector   &  U_3d,
+                       const arma::mat & posterior_weights,
+                       int               n_samples,
+                       int               seed,
+                       const arma::vec & probs,
+                       double            factor,
+                       double            lfsr_thresh,
+                       int               fun_type,
+                       int               n_thread = 1)
+{
+	// set cube data from R 3D array
+	IntegerVector dimU = U_3d.attr("dim");
+	cube U_cube(U_3d.begin(), dimU[0], dimU[1], dimU[2], false, true, false);
+	PosteriorSampler pc(b_mat, s_mat, s_alpha_mat, s_orig_mat, v_mat, l_mat, a_mat, U_cube);
+	if (!m_mat.is_empty()) pc.set_missing(m_mat);
+	run_monitored("calc_post_samples", n_thread, [&]() {
+		pc.sample(posterior_weights, n_samples, seed, probs, factor, lfsr_thresh, fun_type);
+	});
+	return List::create(
+		Named("quantiles")     = pc.Quantiles(),
+		Named("neg_freq")      = pc.NegativeFreq(),
+		Named("pos_freq")      = pc.PositiveFreq(),
+		Named("share_counts")  = pc.SharingCounts(),
+		Named("share_effects") = pc.SharingEffects());
+} // calc_post_samples_rcpp
+
+// Pairwise sharing from posterior means (a J x Q matrix) or from posterior
+// samples (a J x Q x M array)
+// [[Rcpp::export]]
+List
+pairwise_sharing_rcpp(NumericVector   &  x_3d,
+                      const arma::mat & lfsr_mat,
+                      double            factor,
+                      double            lfsr_thresh,
+                      int               fun_type,
+                      bool              na_rm,
+                      int               n_thread = 1)
+{
+	IntegerVector dimX = x_3d.attr("dim");
+	int M = (dimX.size() == 3) ? dimX[2] : 1;
+	const cube x_cube(x_3d.begin(), dimX[0], dimX[1], M, false, true, false);
+	mat share_num, share_den;
+	run_monitored("pairwise_sharing", n_thread, [&]() {
+		pairwise_sharing(x_cube, lfsr_mat, factor, lfsr_thresh, fun_type, na_rm,
+		                 share_num, share_den);
+	});
+	return List::create(Named("share_counts")  = share_num,
+	                    Named("share_effects") = share_den);
+} // pairwise_sharing_rcpp
+
+// Fits independent mash problems concurrently. Each element of
+// problem_list is a list with b_mat, s_mat, s_alpha_mat and m_mat (R x J,
+// m_mat possibly empty) and v_mat (R x R). The R objects are converted
+// before, and the results built after, the monitored parallel region.
+// [[Rcpp::export]]
+List
+fit_mash_batch_rcpp(const List      &  problem_list,
+                    NumericVector   &  U_3d,
+                    const arma::vec & prior,
+                    int               maxiter,
+                    double            tol,
+                    double            pi_thresh,
+                    int               n_thread = 1)
+{
+	IntegerVector dimU = U_3d.attr("dim");
+	cube U_cube(U_3d.begin(), dimU[0], dimU[1], dimU[2], false, true, false);
+	std::vector<MashProblem> problems(problem_list.size());
+	for (size_t i = 0; i < problems.size(); ++i) {
+		List pb = problem_list[i];
+		problems[i].b_mat       = Rcpp::as<arma::mat>(pb["b_mat"]);
+		problems[i].s_mat       = Rcpp::as<arma::mat>(pb["s_mat"]);
+		problems[i].s_alpha_mat = Rcpp::as<arma::mat>(pb["s_alpha_mat"]);
+		problems[i].v_mat       = Rcpp::as<arma::mat>(pb["v_mat"]);
+		problems[i].m_mat       = Rcpp::as<arma::mat>(pb["m_mat"]);
+	}
+	int n_failed = 0;
+	run_monitored("fit_mash_batch", n_thread, [&]() {
+		n_failed = fit_mash_batch(problems, U_cube, prior, maxiter, tol, pi_thresh);
+	});
+	List res(problems.size());
+	for (size_t i = 0; i < problems.size(); ++i) {
+		const MashProblem & pb = problems[i];
+		res[i] = List::create(
+			Named("pi")        = pb.pi,
+			Named("loglik")    = pb.loglik,
+			Named("niter")     = pb.niter,
+			Named("status")    = pb.status,
+			Named("message")   = pb.message,
+			Named("post_mean") = pb.post_mean.t(),
+			Named("post_sd")   = pb.post_sd.t(),
+			Named("post_neg")  = pb.neg_prob.t(),
+			Named("post_zero") = pb.zero_prob.t(),
+			Named("lfsr")      = pb.lfsr.t());
+	}
+	return List::create(Named("problems") = res,
+	                    Named("status")   = n_failed);
+} // fit_mash_batch_rcpp
+
+// Bootstrap of the mixture proportions from one J x P likelihood matrix
+// [[Rcpp::export]]
+List
+bootstrap_pi_rcpp(const arma::mat & lik_mat,
+                  const arma::vec & offset,
+                  const arma::vec & prior,
+                  const arma::vec & pi_init,
+                  int               B,
+                  int               seed,
+                  int               maxiter,
+                  double            tol,
+                  int               n_thread = 1)
+{
+	mat pi_mat;
+	vec loglik;
+	arma::ivec niter;
+	run_monitored("Bootstrap", n_thread, [&]() {
+		bootstrap_mixture(lik_mat, offset, prior, pi_init, B, seed, maxiter, tol,
+		                  pi_mat, loglik, niter);
+	});
+	return List::create(Named("pi")     = pi_mat.t(),
+	                    Named("loglik") = loglik,
+	                    Named("niter")  = niter);
+}
+
+#ifndef _WIN32
+static void
+finalize_server(SEXP server)
+{
+	ScoringServer * ptr = static_cast<ScoringServer *>(R_ExternalPtrAddr(server));
+	if (ptr) {
+		delete ptr;
+		R_ClearExternalPtr(server);
+	}
+}
+
+static ScoringServer *
+get_server(SEXP server)
+{
+	if (TYPEOF(server) != EXTPTRSXP || !R_ExternalPtrAddr(server))
+		throw std::invalid_argument("the scoring server has been stopped");
+	return static_cast<ScoringServer *>(R_ExternalPtrAddr(server));
+}
+#endif
+
+// [[Rcpp::export]]
+SEXP
+start_server_rcpp(const std::string & path)
+{
+	#ifdef _WIN32
+	throw std::runtime_error("the scoring server is not available on Windows");
+	#else
+	SEXP server = PROTECT(R_MakeExternalPtr(new ScoringServer(path), R_NilValue, R_NilValue));
+	R_RegisterCFinalizerEx(server, finalize_server, TRUE);
+	UNPROTECT(1);
+	return server;
+	#endif
+}
+
+// [[Rcpp::export]]
+int
+add_server_model_rcpp(SEXP              server,
+                      NumericVector &   U_3d,
+                      const arma::vec & pi,
+                      const arma::mat & v_mat,
+                      double            alpha,
+                      double            pi_thresh)
+{
+	#ifdef _WIN32
+	throw std::runtime_error("the scoring server is not available on Windows");
+	#else
+	IntegerVector dimU = U_3d.attr("dim");
+	cube U_cube(U_3d.begin(), dimU[0], dimU[1], dimU[2], false, true, false);
+	std::shared_ptr<const ScoringModel> model(new ScoringModel(U_cube, pi, v_mat, alpha, pi_thresh));
+	return get_server(server)->add_model(model);
+	#endif
+}
+
+// [[Rcpp::export]]
+List
+server_stats_rcpp(SEXP server)
+{
+	#ifdef _WIN32
+	throw std::runtime_error("the scoring server is not available on Windows");
+	#else
+	const ScoringServer * ptr = get_server(server);
+	return List::create(Named("running")  = ptr->is_running(),
+	                    Named("uptime")   = ptr->uptime(),
+	                    Named("requests") = (double) ptr->requests(),
+	                    Named("effects")  = (double) ptr->effects(),
+	                    Named("errors")   = (double) ptr->errors(),
+	                    Named("busy")     = ptr->busy());
+	#endif
+}
+
+// [[Rcpp::export]]
+int
+stop_server_rcpp(SEXP server)
+{
+	#ifndef _WIN32
+	if (TYPEOF(server) == EXTPTRSXP) finalize_server(server);
+	#endif
+	return 0;
+}
+
+// [[Rcpp::export]]
+List
+score_server_rcpp(const std::string & path,
+                  int                 model,
+                  const arma::mat &   b_mat,
+                  const arma::mat &   s_mat)
+{
+	#ifdef _WIN32
+	throw std::runtime_error("the scoring server is not available on Windows");
+	#else
+	mat post_mean, post_sd, lfsr;
+	uint32_t status = score_remote(path, model, b_mat, s_mat, post_mean, post_sd, lfsr);
+	if (status != SERVER_OK)
+		return List::create(Named("status") = (int) status);
+	return List::create(Named("post_mean") = post_mean.t(),
+	                    Named("post_sd")   = post_sd.t(),
+	                    Named("lfsr")      = lfsr.t(),
+	                    Named("status")    = 0);
+	#endif
+}
+
+// inputs of prepare_data from R: s of length 1 is a constant, pval of
+// length 0 is not given, and df of length 1 is a constant
+static PrepareInput
+get_prepare_input(NumericVector & b, NumericVector & s, NumericVector & pval,
+                  NumericVector & df, int J, int R, double alpha,
+                  double zero_tol, double zero_both_reset, double zero_s_reset)
+{
+	PrepareInput in;
+	in.b               = b.begin();
+	in.s               = (s.size() == 1) ? NULL : s.begin();
+	in.s_value         = (s.size() == 1) ? s[0] : 1;
+	in.pval            = (pval.size() == 0) ? NULL : pval.begin();
+	in.df              = (df.size() == 1) ? NULL : df.begin();
+	in.df_value        = (df.size() == 1) ? df[0] : R_PosInf;
+	in.J               = J;
+	in.R               = R;
+	in.alpha           = alpha;
+	in.zero_tol        = zero_tol;
+	in.zero_both_reset = zero_both_reset;
+	in.zero_s_reset    = zero_s_reset;
+	// GSL's default handler aborts on a domain error, taking R with it;
+	// invalid inputs give NaN instead, as in the R version
+	gsl_set_error_handler_off();
+	return in;
+}
+
+// [[Rcpp::export]]
+List
+prepare_data_rcpp(NumericVector & b,
+                  NumericVector & s,
+                  NumericVector & pval,
+                  NumericVector & df,
+                  int             J,
+                  int             R,
+                  double          alpha,
+                  double          zero_tol,
+                  double          zero_both_reset,
+                  double          zero_s_reset,
+                  int             n_thread = 1)
+{
+	PrepareInput in = get_prepare_input(b, s, pval, df, J, R, alpha, zero_tol,
+	                                    zero_both_reset, zero_s_reset);
+	PrepareSummary sm;
+	#ifdef _OPENMP
+	omp_set_num_threads(n_thread);
+	#endif
+	prepare_scan(in, sm);
+	int status = prepare_status(sm);
+	if (status != PREPARE_OK) return List::create(Named("status") = status);
+	Rcpp::NumericMatrix b_out(J, R), s_out(J, R), sa_out(J, R);
+	Rcpp::LogicalMatrix m_out(sm.n_na > 0 ? J : 0, sm.n_na > 0 ? R : 0);
+	prepare_data(in, sm, b_out.begin(), s_out.begin(), sa_out.begin(),
+	             (sm.n_na > 0) ? m_out.begin() : NULL);
+	return List::create(Named("Bhat")       = b_out,
+	                    Named("Shat")       = s_out,
+	                    Named("Shat_alpha") = sa_out,
+	                    Named("missing")    = (sm.n_na > 0) ? (SEXP) m_out : R_NilValue,
+	                    Named("scaled")     = alpha != 0 && sm.n_not_one > 0,
+	                    Named("status")     = status);
+}
+
+// [[Rcpp::export]]
+List
+write_data_rcpp(const std::string & path,
+                NumericVector &     b,
+                NumericVector &     s,
+                NumericVector &     pval,
+                NumericVector &     df,
+                int                 J,
+                int                 R,
+                double              alpha,
+                double              zero_tol,
+                double              zero_both_reset,
+                double              zero_s_reset,
+                int                 n_thread = 1)
+{
+	PrepareInput in = get_prepare_input(b, s, pval, df, J, R, alpha, zero_tol,
+	                                    zero_both_reset, zero_s_reset);
+	PrepareSummary sm;
+	#ifdef _OPENMP
+	omp_set_num_threads(n_thread);
+	#endif
+	int status = write_prepared_data(path, in, sm);
+	return List::create(Named("missing") = status == PREPARE_OK && sm.n_na > 0,
+	                    Named("status")  = status);
+}
+
+// [[Rcpp::export]]
+List
+read_data_rcpp(const std::string & path, double start, double n)
+{
+	MashDataReader reader(path);
+	if (start < 0 || start > reader.n_effects())
+		throw std::out_of_range("start is out of range");
+	if (n < 0) n = reader.n_effects() - start;
+	mat b_mat, s_mat, s_alpha_mat;
+	arma::umat m_mat;
+	reader.read(start, n, b_mat, s_mat, s_alpha_mat, m_mat);
+	SEXP missing = R_NilValue;
+	if (reader.has_missing()) {
+		Rcpp::LogicalMatrix m(n, reader.n_conditions());
+		for (uword j = 0; j < m_mat.n_cols; ++j)
+			for (uword r = 0; r < m_mat.n_rows; ++r) m(j, r) = m_mat.at(r, j);
+		missing = m;
+	}
+	return List::create(Named("Bhat")       = b_mat.t(),
+	                    Named("Shat")       = s_mat.t(),
+	                    Named("Shat_alpha") = s_alpha_mat.t(),
+	                    Named("missing")    = missing,
+	                    Named("alpha")      = reader.alpha(),
+	                    Named("n_effects")  = (double) reader.n_effects());
+}
+
+// the options of a compact result file, from list(chunk_size, sd, prob,
+// lfdr) with the encodings numbered as MASH_ENC_*
+MashCompactOptions
+compact_options(const List & compact)
+{
+	MashCompactOptions opt;
+	opt.chunk    = Rcpp::as<double>(compact["chunk_size"]);
+	opt.enc_sd   = Rcpp::as<int>(compact["sd"]);
+	opt.enc_prob = Rcpp::as<int>(compact["prob"]);
+	opt.lfdr     = Rcpp::as<bool>(compact["lfdr"]);
+	return opt;
+}
+
+// the effects and conditions (0-based) of a compact result file as n x R
+// matrices, in the order asked for
+List
+read_compact(MashCompactReader & reader, const arma::uvec & effects,
+             const arma::uvec & conds)
+{
+	mat out[MASH_N_FIELDS];
+	vec loglik;
+	reader.read(effects, conds, out, loglik);
+	List res = List::create(Named("PosteriorMean") = out[MASH_FIELD_MEAN].t(),
+	                        Named("PosteriorSD")   = out[MASH_FIELD_SD].t(),
+	                        Named("lfsr")          = out[MASH_FIELD_LFSR].t(),
+	                        Named("NegativeProb")  = out[MASH_FIELD_NEG].t());
+	if (reader.has_lfdr()) res.push_back(out[MASH_FIELD_LFDR].t(), "lfdr");
+	if (reader.has_loglik()) res.push_back(loglik, "vloglik");
+	if (reader.has_names()) {
+		Rcpp::CharacterVector effect_names(effects.n_elem), cond_names(conds.n_elem);
+		for (uword i = 0; i < effects.n_elem; ++i) effect_names[i] = reader.name(effects.at(i));
+		for (uword i = 0; i < conds.n_elem; ++i)
+			cond_names[i] = reader.name(reader.n_effects() + conds.at(i));
+		res.push_back(effect_names, "effect_names");
+		res.push_back(cond_names, "condition_names");
+	}
+	return res;
+}
+
+// Posterior summaries of the effects in a data file, written to a result
+// file by MashPipeline
+// [[Rcpp::export]]
+List
+run_pipeline_rcpp(const std::string & in_path,
+                  const std::string & out_path,
+                  NumericVector     & U_3d,
+                  const arma::vec   & pi,
+                  const arma::mat   & v_mat,
+                  double              pi_thresh,
+                  double              chunk_size,
+                  int                 n_workers,
+                  double              depth,
+                  SEXP                compact)
+{
+	IntegerVector dimU = U_3d.attr("dim");
+	cube U_cube(U_3d.begin(), dimU[0], dimU[1], dimU[2], false, true, false);
+	MashCompactOptions opt;
+	if (!Rf_isNull(compact)) opt = compact_options(List(compact));
+	PipelineStats stats;
+	run_monitored("Posterior", 1, [&]() {
+		// the workers count the effects of each chunk they finish
+		progress_expect(MashDataReader(in_path).n_effects());
+		MashPipeline pipeline(U_cube, pi, v_mat, pi_thresh, chunk_size, n_workers, depth);
+		stats = pipeline.run(in_path, out_path, Rf_isNull(compact) ? NULL : &opt);
+	});
+	return List::create(Named("chunks")        = (double) stats.n_chunks,
+	                    Named("max_in_flight") = (double) stats.max_in_flight,
+	                    Named("wall")          = stats.wall,
+	                    Named("read")          = stats.read,
+	                    Named("compute")       = stats.compute,
+	                    Named("write")         = stats.write);
+}
+
+// [[Rcpp::export]]
+List
+read_results_rcpp(const std::string & path, double start, double n)
+{
+	if (is_compact_result_file(path)) {
+		MashCompactReader reader(path);
+		if (start < 0 || start > reader.n_effects())
+			throw std::out_of_range("start is out of range");
+		if (n < 0) n = reader.n_effects() - start;
+		if (start + n > reader.n_effects())
+			throw std::out_of_range("effects out of range in " + path);
+		uvec effects = n > 0 ? arma::regspace<uvec>(start, start + n - 1) : uvec();
+		return read_compact(reader, effects,
+		                    arma::regspace<uvec>(0, reader.n_conditions() - 1));
+	}
+	MashResultReader reader(path);
+	if (start < 0 || start > reader.n_effects())
+		throw std::out_of_range("start is out of range");
+	if (n < 0) n = reader.n_effects() - start;
+	mat post_mean, post_sd, lfsr, neg_prob;
+	vec loglik;
+	reader.read(start, n, post_mean, post_sd, lfsr, neg_prob, loglik);
+	return List::create(Named("PosteriorMean") = post_mean.t(),
+	                    Named("PosteriorSD")   = post_sd.t(),
+	                    Named("lfsr")          = lfsr.t(),
+	                    Named("NegativeProb")  = neg_prob.t(),
+	                    Named("vloglik")       = loglik);
+}
+
+// Writes J x R results to a compact file; lfdr and loglik may be empty,
+// and names holds the J effect and R condition names, or nothing
+// [[Rcpp::export]]
+void
+write_compact_rcpp(const std::string & path, const arma::mat & post_mean,
+                   const arma::mat & post_sd, const arma::mat & lfsr,
+                   const arma::mat & neg_prob, const arma::mat & lfdr,
+                   const arma::vec & loglik, const std::vector<std::string> & names,
+                   List compact)
+{
+	MashCompactOptions opt = compact_options(compact);
+	opt.lfdr  = !lfdr.is_empty();
+	uword J   = post_mean.n_rows, R = post_mean.n_cols;
+	MashCompactWriter writer(path, J, R, opt, !loglik.is_empty());
+	for (uword j0 = 0; j0 < J; j0 += opt.chunk) {
+		uword j1 = std::min(J, j0 + opt.chunk) - 1;
+		writer.append(trans(post_mean.rows(j0, j1)), trans(post_sd.rows(j0, j1)),
+		              trans(lfsr.rows(j0, j1)), trans(neg_prob.rows(j0, j1)),
+		              opt.lfdr ? mat(trans(lfdr.rows(j0, j1))) : mat(),
+		              loglik.is_empty() ? vec() : vec(loglik.subvec(j0, j1)));
+	}
+	writer.close(names);
+}
+
+// [[Rcpp::export]]
+List
+compact_info_rcpp(const std::string & path)
+{
+	MashCompactReader reader(path);
+	Rcpp::CharacterVector cond_names(0);
+	if (reader.has_names()) {
+		cond_names = Rcpp::CharacterVector(reader.n_conditions());
+		for (uword r = 0; r < reader.n_conditions(); ++r)
+			cond_names[r] = reader.name(reader.n_effects() + r);
+	}
+	return List::create(Named("J")               = (double) reader.n_effects(),
+	                    Named("R")               = (double) reader.n_conditions(),
+	                    Named("has_names")       = reader.has_names(),
+	                    Named("condition_names") = cond_names);
+}
+
+// The 0-based indices of the effects of the given names, NA for those not
+// in the file
+// [[Rcpp::export]]
+NumericVector
+compact_find_rcpp(const std::string & path, const std::vector<std::string> & names)
+{
+	MashCompactReader reader(path);
+	NumericVector res(names.size());
+	for (size_t i = 0; i < names.size(); ++i) {
+		uword j;
+		res[i] = reader.find(names[i], j) ? (double) j : NA_REAL;
+	}
+	return res;
+}
+
+// [[Rcpp::export]]
+List
+read_compact_rcpp(const std::string & path, const arma::uvec & effects,
+                  const arma::uvec & conds)
+{
+	MashCompactReader reader(path);
+	return read_compact(reader, effects, conds);
+}
+
+// [[Rcpp::export]]
+arma::cube
+udi_cov_rcpp(const arma::mat & v_mat, const arma::imat & models, int n_thread = 1)
+{
+	#ifdef _OPENMP
+	omp_set_num_threads(n_thread);
+	#endif
+	UDIGenerator gen(v_mat);
+	cube U_cube(v_mat.n_rows, v_mat.n_rows, models.n_rows);
+	#pragma omp parallel for schedule(static) default(none) shared(gen, models, U_cube)
+	for (uword k = 0; k < models.n_rows; ++k)
+		U_cube.slice(k) = gen.cov(trans(models.row(k)));
+	return U_cube;
+}
+
+// [[Rcpp::export]]
+List
+udi_select_rcpp(const arma::mat & b_mat,
+                const arma::mat & s_mat,
+                const arma::mat & v_mat,
+                const arma::imat & models,
+                const arma::vec & grid,
+                const arma::uvec & screen,
+                int               n_top,
+                int               n_rescore,
+                int               n_thread = 1)
+{
+	arma::imat selected;
+	vec scores;
+	cube U_cube;
+	run_monitored("UDI models", n_thread, [&]() {
+		UDIGenerator gen(v_mat);
+		std::vector<uword> ids;
+		udi_select(gen, models, b_mat, s_mat, v_mat, grid, screen, n_top,
+		           n_rescore, ids, scores);
+		uword R = v_mat.n_rows;
+		selected.set_size(ids.size(), R);
+		U_cube.set_size(R, R, ids.size());
+		for (size_t i = 0; i < ids.size(); ++i) {
+			arma::ivec model = models.is_empty() ? udi_model(ids[i], R) : arma::ivec(trans(models.row(ids[i])));
+			selected.row(i)  = model.t();
+			U_cube.slice(i)  = gen.cov(model);
+		}
+	});
+	return List::create(Named("models") = selected,
+	                    Named("score")  = scores,
+	                    Named("U")      = U_cube);
+}
+
+// Placement of the threads and arrays of the last monitored computation
+// [[Rcpp::export]]
+List
+numa_report_rcpp()
+{
+	NumaReport & r = numa_report();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	IntegerVector thread(r.threads.size()), cpu(r.threads.size()), node(r.threads.size());
+	for (size_t i = 0; i < r.threads.size(); ++i) {
+		thread[i] = r.threads[i].thread;
+		cpu[i]    = r.threads[i].cpu;
+		node[i]   = r.threads[i].node;
+	}
+	int n_nodes = numa_n_nodes();
+	Rcpp::CharacterVector name(r.arrays.size());
+	Rcpp::NumericMatrix pages(r.arrays.size(), n_nodes + 1);
+	for (size_t i = 0; i < r.arrays.size(); ++i) {
+		name[i] = r.arrays[i].name;
+		for (int k = 0; k <= n_nodes; ++k) pages(i, k) = r.arrays[i].pages[k];
+	}
+	return List::create(Named("nodes")   = n_nodes,
+	                    Named("enabled") = r.enabled,
+	                    Named("pinned")  = r.pinned,
+	                    Named("thread")  = thread,
+	                    Named("cpu")     = cpu,
+	                    Named("node")    = node,
+	                    Named("array")   = name,
+	                    Named("pages")   = pages);
+}
+
+// Truncated SVD of the rows (0-based) of x_mat, read in place
+// [[Rcpp::export]]
+List
+rsvd_rcpp(const arma::mat & x_mat, const arma::uvec & rows, int k,
+          int n_over = 10, int n_power = 2, int seed = 1, int n_thread = 1)
+{
+	#ifdef _OPENMP
+	omp_set_num_threads(n_thread);
+	#endif
+	if (arma::any(rows >= x_mat.n_rows)) Rcpp::stop("rows out of range");
+	vec d;
+	mat v_mat;
+	if (randomized_svd(x_mat, rows, k, n_over, n_power, seed, d, v_mat) != 0)
+		Rcpp::stop("SVD did not converge");
+	return List::create(Named("d") = d, Named("v") = v_mat);
+}
+
+// A single effect regression of mvSuSiE from the genotypes x and the
+// residuals y_mat (N x R): a numeric matrix, a dgCMatrix, or a list with
+// the file, nrow and ncol of a matrix stored as by writeBin, which is
+// memory mapped. The sufficient statistics go to MVSERMix without
+// returning to R. Uinv_3d, if given, requests the EM update of the prior
+// scale as in calc_sermix_rcpp.
+// [[Rcpp::export]]
+List
+calc_mvser_rcpp(SEXP              x,
+                const arma::mat & y_mat,
+                const arma::vec & center,
+                const arma::vec & scale,
+                const arma::vec & xtx,
+                const arma::mat & resid_var,
+                NumericVector   &  U_3d,
+                NumericVector   &  Uinv_3d,
+                const arma::vec & pi,
+                const arma::vec & prior_weights,
+                int               n_thread = 1)
+{
+	IntegerVector dimU = U_3d.attr("dim");
+	cube U_cube(U_3d.begin(), dimU[0], dimU[1], dimU[2], false, true, false);
+	cube Uinv_cube;
+	if (!Rf_isNull(Uinv_3d.attr("dim")))
+		Uinv_cube = cube(Uinv_3d.begin(), dimU[0], dimU[1], dimU[2], false, true, false);
+	// the genotypes, without copying a dense or mapped matrix
+	arma::sp_mat x_sparse;
+	mat x_dense;
+	std::unique_ptr<MappedMatrix> x_mapped;
+	bool sparse = Rf_isS4(x);
+	if (sparse) {
+		x_sparse = Rcpp::as<arma::sp_mat>(x);
+	} else if (Rf_isMatrix(x) && TYPEOF(x) == REALSXP) {
+		x_dense = mat(REAL(x), Rf_nrows(x), Rf_ncols(x), false, true);
+	} else if (TYPEOF(x) == VECSXP) {
+		List x_file(x);
+		x_mapped.reset(new MappedMatrix(Rcpp::as<std::string>(x_file["file"]),
+		                                Rcpp::as<double>(x_file["nrow"]),
+		                                Rcpp::as<double>(x_file["ncol"])));
+		x_dense = x_mapped->get();
+	} else throw std::invalid_argument("x should be a numeric matrix, a dgCMatrix or a mapped file");
+	uword N = sparse ? x_sparse.n_rows : x_dense.n_rows;
+	uword J = sparse ? x_sparse.n_cols : x_dense.n_cols;
+	if (y_mat.n_rows != N) throw std::invalid_argument("x and y have different numbers of rows");
+	if ((!center.is_empty() && center.n_elem != J) || (!scale.is_empty() && scale.n_elem != J) ||
+	    (!xtx.is_empty() && xtx.n_elem != J) || prior_weights.n_elem != J)
+		throw std::invalid_argument("center, scale, xtx and prior_weights should have one value per column of x");
+
+	mat b_mat, s_mat, mix_weights;
+	vec d = xtx, lbf, alpha;
+	double lbf_model = 0;
+	// correlation of the residuals
+	vec sd    = sqrt(resid_var.diag());
+	mat v_mat = resid_var / (sd * sd.t());
+	std::unique_ptr<MVSERMix> ser;
+	run_monitored("mvSER", n_thread, [&]() {
+		if (sparse) ser_sufficient_stats(x_sparse, y_mat, center, scale, d, resid_var, b_mat, s_mat);
+		else ser_sufficient_stats(x_dense, y_mat, center, scale, d, resid_var, b_mat, s_mat);
+		if (progress_cancelled()) return;
+		ser.reset(new MVSERMix(b_mat, s_mat, v_mat, U_cube));
+		lbf_model = mvser_fit(*ser, b_mat, s_mat, v_mat, U_cube, Uinv_cube, pi,
+		                      prior_weights, lbf, alpha, mix_weights, n_thread);
+	});
+	List res = List::create(
+		Named("bhat")      = b_mat.t(),
+		Named("shat")      = s_mat.t(),
+		Named("xtx")       = d,
+		Named("lbf")       = lbf,
+		Named("lbf_model") = lbf_model,
+		Named("alpha")     = alpha,
+		Named("mixture_posterior_weights") = mix_weights.t(),
+		Named("post_mean") = ser->PosteriorMean(),
+		Named("post_sd")   = ser->PosteriorSD(),
+		Named("post_cov")  = ser->PosteriorCov(),
+		Named("post_zero") = ser->ZeroProb(),
+		Named("post_neg")  = ser->NegativeProb());
+	if (!Uinv_cube.is_empty()) res.push_back(ser->PriorScalar(), "prior_scale_em_update");
+	return res;
+} // calc_mvser_rcpp
+
 // [[Rcpp::export]]
 List
 calc_sermix_rcpp(const arma::mat & b_mat,
@@ -209,7 +983,9 @@ fit_teem_rcpp(const arma::mat & x_mat,
 	IntegerVector dimU = U_3d.attr("dim");
 	cube U_cube(U_3d.begin(), dimU[0], dimU[1], dimU[2], false, true, false);
 	TEEM teem(x_mat, w_vec, U_cube);
-	teem.fit(maxiter, converge_tol, eigen_tol, verbose);
+	run_monitored("TEEM", get_max_threads(), [&]() {
+		teem.fit(maxiter, converge_tol, eigen_tol, verbose);
+	});
 	List res = List::create(
 		Named("w")         = teem.get_w(),
 		Named("U")         = teem.get_U(),
@@ -217,3 +993,26 @@ fit_teem_rcpp(const arma::mat & x_mat,
 		Named("maxd")      = teem.get_maxd());
 	return res;
 }
+
+// Starting values for ED and TEEM from a k-means clustering of the rows
+// of x_mat, whose errors have covariance noise
+// [[Rcpp::export]]
+List
+kmeans_init_rcpp(const arma::mat & x_mat, int K, const arma::mat & noise,
+                 double eigen_floor, int seed = 1, int n_thread = 1)
+{
+	if (noise.n_rows != x_mat.n_cols || noise.n_cols != x_mat.n_cols)
+		Rcpp::stop("noise should be a square matrix with a row per column of x_mat");
+	vec w;
+	cube U_cube;
+	arma::uvec cluster;
+	int status = 0;
+	run_monitored("k-means", n_thread, [&]() {
+		status = kmeans_init(x_mat, K, seed, noise, eigen_floor, w, U_cube, cluster);
+	});
+	if (status != 0) Rcpp::stop("k-means initialisation failed: fewer effects than components?");
+	return List::create(
+		Named("w")       = w,
+		Named("U")       = U_cube,
+		Named("cluster") = cluster + 1);
+}
@@ -2,11 +2,22 @@
 #ifndef _MASH_H
 #define _MASH_H
 #include <cmath>
+#include <cstring>
 #include <armadillo>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <gsl/gsl_cdf.h>
+#include <gsl/gsl_errno.h>
 #ifdef _OPENMP
 # include <omp.h>
 #endif
+#include "progress.h"
+#include "numa.h"
 
 using std::log;
 using std::exp;
@@ -35,6 +46,7 @@ using arma::trace;
 using arma::trans;
 using arma::find;
 using arma::inv;
+using arma::inv_sympd;
 using arma::trimatu;
 using arma::chol;
 using arma::dot;
@@ -49,6 +61,32 @@ const double LOG_INV_SQRT_2PI = log(INV_SQRT_2PI);
 
 // INLINE FUNCTION DEFINITONS
 // --------------------------
+// @title Densities computed by the fallback of dmvnorm and dmvnorm_mat
+// @description the running total, never reset, of the densities whose
+// covariance was not positive definite, so that they were set to 0
+// (-inf on the log scale), or to inf where x equals the mean. A caller
+// counts its own fallbacks as the difference over its call, which is
+// only exact while no other computation adds to the total: the R entry
+// points run one at a time, and the scoring server uses precomputed
+// factors (inversed = true), which never fall back.
+inline std::atomic<unsigned long long> &
+dmvnorm_fallbacks()
+{
+	static std::atomic<unsigned long long> n(0);
+	return n;
+}
+
+// @title rooti = t(chol(sigma)^{-1}), as backsolve(chol(sigma), diag(R)) in R
+// @return false, without throwing, if sigma is not positive definite
+inline bool
+chol_rooti(mat & rooti, const mat & sigma)
+{
+	mat L;
+	if (!chol(L, sigma) || !inv(rooti, trimatu(L))) return false;
+	arma::inplace_trans(rooti);
+	return true;
+}
+
 inline vec
 dnorm(const vec & x,
       const vec & mu,
@@ -77,16 +115,14 @@ dmvnorm_mat(const mat & x,
 
 	// we have previously computed rooti
 	// in R eg rooti <- backsolve(chol(sigma), diag(ncol(x)))
-	if (inversed) { rooti = sigma; } else {
-		try {
-			rooti = trans(inv(trimatu(chol(sigma))));
-		} catch (const std::runtime_error & error) {
-			if (logd) out.fill(-datum::inf);
-			else out.fill(0.0);
-			for (uword i = 0; i < x.n_cols; ++i)
-				if (accu(abs(x.col(i) - mean)) < 1e-6) out.at(i) = datum::inf;
-			return out;
-		}
+	// these loops run in OpenMP threads, where nothing may be thrown
+	if (inversed) { rooti = sigma; } else if (!chol_rooti(rooti, sigma)) {
+		if (logd) out.fill(-datum::inf);
+		else out.fill(0.0);
+		for (uword i = 0; i < x.n_cols; ++i)
+			if (accu(abs(x.col(i) - mean)) < 1e-6) out.at(i) = datum::inf;
+		dmvnorm_fallbacks().fetch_add(x.n_cols, std::memory_order_relaxed);
+		return out;
 	}
 	double rootisum  = sum(log(rooti.diag()));
 	double constants = -(xdim / 2.0) * LOG_2PI;
@@ -111,14 +147,11 @@ dmvnorm(const vec & x,
 {
 	mat rooti;
 
-	if (inversed) { rooti = sigma; } else {
-		try {
-			rooti = trans(inv(trimatu(chol(sigma))));
-		} catch (const std::runtime_error & error) {
-			double diff = accu(abs(x - mean));
-			if (logd) return (diff < 1e-6) ? datum::inf : -datum::inf;
-			else return (diff < 1e-6) ? datum::inf : 0.0;
-		}
+	if (inversed) { rooti = sigma; } else if (!chol_rooti(rooti, sigma)) {
+		dmvnorm_fallbacks().fetch_add(1, std::memory_order_relaxed);
+		double diff = accu(abs(x - mean));
+		if (logd) return (diff < 1e-6) ? datum::inf : -datum::inf;
+		else return (diff < 1e-6) ? datum::inf : 0.0;
 	}
 	double rootisum  = sum(log(rooti.diag()));
 	double constants = -(static_cast<double>(x.n_elem) / 2.0) * LOG_2PI;
@@ -162,7 +195,170 @@ pnorm(const U & x, const T & m, const T & s,
 	}
 }
 
+// number of effects processed together by the blocked kernels: a handful of
+// (rows x block) working matrices should fit in a per-core L2 cache
+const uword BLOCK_CACHE_BYTES = 256 * 1024;
+
+inline uword
+get_block_size(const uword & rows)
+{
+	uword block = BLOCK_CACHE_BYTES / (8 * sizeof(double) * std::max(rows, (uword) 1));
+	return std::max(block, (uword) 16);
+}
+
+// NUMA PLACEMENT
+// --------------
+// See numa.h. These are called after the number of threads is set, so
+// the static schedules below split the work as the engines will.
+
+// @title Size m and zero it with the threads that will write it
+// @param by_col whether the engine splits the columns of m between the
+// threads with a static schedule, rather than its rows
+inline void
+numa_zeros(mat & m, uword n_rows, uword n_cols, bool by_col)
+{
+	m.set_size(n_rows, n_cols);
+	if (by_col) {
+	#pragma omp parallel for schedule(static) default(none) shared(m)
+		for (uword c = 0; c < m.n_cols; ++c)
+			std::memset(m.colptr(c), 0, m.n_rows * sizeof(double));
+	} else {
+	#pragma omp parallel for schedule(static) default(none) shared(m)
+		for (uword r = 0; r < m.n_rows; ++r)
+			for (uword c = 0; c < m.n_cols; ++c) m.at(r, c) = 0;
+	}
+}
+
+// @title Zero a cube slice by slice with the threads that will write it
+inline void
+numa_zeros(cube & c)
+{
+	#pragma omp parallel for schedule(static) default(none) shared(c)
+	for (uword k = 0; k < c.n_slices; ++k)
+		std::memset(c.slice_memptr(k), 0, c.n_elem_slice * sizeof(double));
+}
+
+// @title Copy m column by column with the threads that will read it
+inline void
+numa_copy(const mat & m, mat & copy)
+{
+	copy.set_size(m.n_rows, m.n_cols);
+	#pragma omp parallel for schedule(static) default(none) shared(m, copy)
+	for (uword c = 0; c < m.n_cols; ++c)
+		std::memcpy(copy.colptr(c), m.colptr(c), m.n_rows * sizeof(double));
+}
+
+// LIKELIHOOD COLUMN KEYS
+// ----------------------
+// 64 bit FNV-1a hashes, used to key cached likelihood columns by the data
+// and the scaled prior covariance that produced them
+const unsigned long long FNV_OFFSET = 14695981039346656037ULL;
+const unsigned long long FNV_PRIME  = 1099511628211ULL;
+
+inline unsigned long long
+hash_bytes(const void * data, size_t n, unsigned long long h = FNV_OFFSET)
+{
+	const unsigned char * p = static_cast<const unsigned char *>(data);
+	for (size_t i = 0; i < n; ++i) {
+		h ^= p[i];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+// hashes the dimensions as well, so an empty matrix and a reshaped one
+// give different keys
+inline unsigned long long
+hash_mat(const mat & x, unsigned long long h = FNV_OFFSET)
+{
+	unsigned long long dims[2] = { x.n_rows, x.n_cols };
+	h = hash_bytes(dims, sizeof(dims), h);
+	return hash_bytes(x.memptr(), x.n_elem * sizeof(double), h);
+}
+
+// CONTRAST CLASS
+// --------------
+// @title Structure of a Q by R contrast matrix L
+// @description The contrast matrices from contrast_matrix() in R are
+// differences from a reference condition, or from the mean of all
+// conditions. For these L %*% Sigma %*% t(L) is computed in O(Q^2)
+// from Sigma directly instead of with two matrix products.
+class Contrast
+{
+public:
+explicit Contrast(const mat & L) : L(L), type(GENERAL), ref(0)
+{
+	if (L.is_empty()) {
+		type = NONE;
+		return;
+	}
+	uword Q = L.n_rows, R = L.n_cols;
+	rows.set_size(Q);
+	// differences from a reference condition
+	bool is_ref = Q > 0 && Q + 1 == R;
+	uvec neg = find(L.row(0) == -1.0);
+	if (is_ref && neg.n_elem == 1) ref = neg.at(0);
+	else is_ref = false;
+	for (uword i = 0; is_ref && i < Q; ++i) {
+		uvec pos = find(L.row(i) == 1.0);
+		is_ref = pos.n_elem == 1 && pos.at(0) != ref && L.at(i, ref) == -1.0
+		         && accu(L.row(i) != 0.0) == 2;
+		if (is_ref) rows.at(i) = pos.at(0);
+	}
+	if (is_ref) {
+		type = REFERENCE;
+		return;
+	}
+	// differences from the mean
+	bool is_mean = Q > 0;
+	double off = -1.0 / R, on = 1.0 + off;
+	for (uword i = 0; is_mean && i < Q; ++i) {
+		uvec pos = find(abs(L.row(i) - on) < 1e-12);
+		is_mean = pos.n_elem == 1 && accu(abs(L.row(i) - off) < 1e-12) == R - 1;
+		if (is_mean) rows.at(i) = pos.at(0);
+	}
+	if (is_mean) type = MEAN;
+}
+
+// L %*% Sigma %*% t(L) for symmetric Sigma
+mat
+apply(const mat & Sigma) const
+{
+	if (type == NONE) return Sigma;
+	if (type == GENERAL) return L * Sigma * L.t();
+	mat out = Sigma.submat(rows, rows);
+	vec m;
+	double c;
+	if (type == REFERENCE) {
+		m = Sigma.col(ref);
+		c = Sigma.at(ref, ref);
+	} else {
+		m = arma::mean(Sigma, 1);
+		c = arma::mean(m);
+	}
+	vec m_rows = m.elem(rows);
+	out.each_col() -= m_rows;
+	out.each_row() -= m_rows.t();
+	out += c;
+	return out;
+}
+
+private:
+enum Type { NONE, REFERENCE, MEAN, GENERAL };
+mat L;
+Type type;
+uword ref;
+uvec rows; // condition of the positive term in each contrast
+};
+
 // a quicker way to compute diag(s) %*% V %*% diag(s)
+inline mat
+get_cov(const vec & s, const mat & V, const Contrast & L)
+{
+	/* return L %*% arma::diagmat(s) * V * arma::diagmat(s) %*% t(L); */
+	return L.apply((V.each_col() % s).each_row() % s.t());
+}
+
 inline mat
 get_cov(const vec & s, const mat & V, const mat & L)
 {
@@ -170,8 +366,7 @@ get_cov(const vec & s, const mat & V, const mat & L)
 		/* return arma::diagmat(s) * V * arma::diagmat(s); */
 		return (V.each_col() % s).each_row() % s.t();
 	} else {
-		mat svs = (V.each_col() % s).each_row() % s.t();
-		return L * svs * L.t();
+		return get_cov(s, V, Contrast(L));
 	}
 }
 
@@ -182,6 +377,79 @@ get_cov(const vec & s, const mat & V)
 	return (V.each_col() % s).each_row() % s.t();
 }
 
+// EFFECT GROUPS
+// -------------
+// Effects sharing the same set of observed conditions and the same
+// standard errors on them, and therefore the same likelihood covariance
+// and factorisations.
+struct EffectGroup
+{
+	uvec obs;     // observed conditions
+	uvec effects; // effects in the group
+};
+
+// @param s_mat R by J standard errors that define the covariance of each effect
+// @param m_mat R by J missingness mask, non-zero for missing measurements; may be empty
+// @param n_obs dimension of the effects, when there is no mask
+inline std::vector<EffectGroup>
+group_effects(const mat & s_mat, const mat & m_mat, uword n_obs)
+{
+	std::vector<EffectGroup> groups;
+	std::vector<std::vector<uword> > members;
+	std::map<std::string, size_t> index;
+	const size_t width = 1 + sizeof(double);
+
+	for (uword j = 0; j < s_mat.n_cols; ++j) {
+		std::string key(s_mat.n_rows * width, '\0');
+		for (uword r = 0; r < s_mat.n_rows; ++r) {
+			if (!m_mat.is_empty() && m_mat.at(r, j) != 0) key[r * width] = 1;
+			else std::memcpy(&key[r * width + 1], s_mat.colptr(j) + r, sizeof(double));
+		}
+		std::map<std::string, size_t>::iterator it = index.find(key);
+		if (it == index.end()) {
+			EffectGroup group;
+			if (m_mat.is_empty()) group.obs = arma::regspace<uvec>(0, n_obs - 1);
+			else group.obs = find(m_mat.col(j) == 0);
+			index[key] = groups.size();
+			groups.push_back(group);
+			members.push_back(std::vector<uword>(1, j));
+		} else {
+			members[it->second].push_back(j);
+		}
+	}
+	for (size_t g = 0; g < groups.size(); ++g)
+		groups[g].effects = arma::conv_to<uvec>::from(members[g]);
+	return groups;
+}
+
+// groups with at least this many effects are processed one at a time, with
+// the threads sharing the group; smaller groups are processed concurrently
+const uword LARGE_GROUP = 64;
+
+// @title get_missing_factors
+// @description Factors of the posterior of b given only the observed
+// conditions o of bhat, with sampling covariance sigma (R x R):
+// b | bhat_o ~ N(K' bhat_o, U0), K = (U[o,o] + sigma[o,o])^{-1} U[o,] and
+// U0 = U - U[,o] K. This is the limit of setting an infinite standard error
+// for the missing conditions, without the ill-conditioned R x R inverse.
+// @param K_cube |o| by R by P output
+// @param U0_cube R by R by P output
+inline void
+get_missing_factors(const mat & sigma, const uvec & obs, const cube & U_cube,
+                    cube & K_cube, cube & U0_cube)
+{
+	K_cube.zeros(obs.n_elem, U_cube.n_rows, U_cube.n_slices);
+	U0_cube = U_cube;
+	if (obs.n_elem == 0) return;
+
+	mat sigma_o = sigma.submat(obs, obs);
+	for (uword p = 0; p < U_cube.n_slices; ++p) {
+		mat U_o = U_cube.slice(p).rows(obs);
+		K_cube.slice(p)   = arma::solve(sigma_o + U_o.cols(obs), U_o);
+		U0_cube.slice(p) -= U_o.t() * K_cube.slice(p);
+	}
+}
+
 // @title posterior_cov
 // @param Vinv R x R inverse covariance matrix for the likelihood
 // @param U R x R prior covariance matrix
@@ -300,6 +568,43 @@ mash_compute_posterior_comcov(const mat&   b_mat,
                               const mat &  posterior_weights,
                               const int &  report_type);
 
+int
+mash_compute_posterior_grouped(const mat&   b_mat,
+                               const SE &   s_obj,
+                               const mat &  v_mat,
+                               const mat &  l_mat,
+                               const mat &  m_mat,
+                               const mat &  a_mat,
+                               const cube & U_cube,
+                               mat &        post_mean,
+                               mat &        post_var,
+                               mat &        neg_prob,
+                               mat &        zero_prob,
+                               cube &       post_cov,
+                               const mat &  posterior_weights,
+                               const int &  report_type);
+
+int
+mash_sample_posterior(const mat&   b_mat,
+                      const SE &   s_obj,
+                      const mat &  v_mat,
+                      const mat &  l_mat,
+                      const mat &  m_mat,
+                      const mat &  a_mat,
+                      const cube & U_cube,
+                      const mat &  posterior_weights,
+                      const uword  n_samples,
+                      const uword  seed,
+                      const vec &  probs,
+                      const double factor,
+                      const double lfsr_thresh,
+                      const int    fun_type,
+                      cube &       quantiles,
+                      mat &        neg_freq,
+                      mat &        pos_freq,
+                      mat &        share_num,
+                      mat &        share_den);
+
 int
 mvsermix_compute_posterior(const mat&  b_mat,
                            const mat & s_mat,
@@ -365,16 +670,12 @@ PosteriorMASH(const mat &  b_mat,
 	if (!a_mat.is_empty()) {
 		R = a_mat.n_rows;
 	}
+	// the outputs are zeroed by place() before they are computed
 	post_mean.set_size(R, J);
 	post_var.set_size(R, J);
 	post_cov.set_size(R, R, J);
 	neg_prob.set_size(R, J);
 	zero_prob.set_size(R, J);
-	post_mean.zeros();
-	post_var.zeros();
-	post_cov.zeros();
-	neg_prob.zeros();
-	zero_prob.zeros();
 	#ifdef _OPENMP
 	omp_set_num_threads(1);
 	#endif
@@ -390,6 +691,12 @@ PosteriorMASH(const mat &  b_mat,
 int
 compute_posterior(const mat & posterior_weights, const int & report_type)
 {
+	place();
+	if (!m_mat.is_empty() || (!l_mat.is_empty() && Vinv_cube.is_empty() && U0_cube.is_empty()))
+		return mash_compute_posterior_grouped(b_mat, s_obj, v_mat, l_mat, m_mat,
+		                                      a_mat, U_cube, post_mean, post_var,
+		                                      neg_prob, zero_prob, post_cov,
+		                                      posterior_weights, report_type);
 	return mash_compute_posterior(b_mat, s_obj, v_mat, l_mat, a_mat, U_cube,
 	                              Vinv_cube, U0_cube, post_mean, post_var,
 	                              neg_prob, zero_prob, post_cov,
@@ -403,6 +710,12 @@ compute_posterior(const mat & posterior_weights, const int & report_type)
 int
 compute_posterior_comcov(const mat & posterior_weights, const int & report_type)
 {
+	place();
+	if (!m_mat.is_empty())
+		return mash_compute_posterior_grouped(b_mat, s_obj, v_mat, l_mat, m_mat,
+		                                      a_mat, U_cube, post_mean, post_var,
+		                                      neg_prob, zero_prob, post_cov,
+		                                      posterior_weights, report_type);
 	return mash_compute_posterior_comcov(b_mat, s_obj, v_mat, l_mat, a_mat,
 	                                     U_cube, Vinv_cube, U0_cube, post_mean,
 	                                     post_var, neg_prob, zero_prob,
@@ -425,6 +738,14 @@ set_U0(const cube & value)
 	return 0;
 }
 
+// R X J missingness mask, non-zero for missing measurements
+int
+set_missing(const mat & value)
+{
+	m_mat = value;
+	return 0;
+}
+
 int
 set_thread(const int & value)
 {
@@ -470,6 +791,7 @@ SE s_obj;
 mat v_mat;
 mat l_mat;
 mat a_mat;
+mat m_mat;
 cube U_cube;
 cube Vinv_cube;
 cube U0_cube;
@@ -481,6 +803,143 @@ mat neg_prob;
 mat zero_prob;
 // J X R X R cube
 cube post_cov;
+
+// places the effects and the outputs on the nodes of the threads that
+// compute them, and zeroes the outputs
+void
+place()
+{
+	if (numa_n_nodes() > 1) {
+		mat copy;
+		numa_copy(b_mat, copy);
+		b_mat.swap(copy);
+	}
+	numa_zeros(post_mean, post_mean.n_rows, post_mean.n_cols, true);
+	numa_zeros(post_var, post_var.n_rows, post_var.n_cols, true);
+	numa_zeros(neg_prob, neg_prob.n_rows, neg_prob.n_cols, true);
+	numa_zeros(zero_prob, zero_prob.n_rows, zero_prob.n_cols, true);
+	numa_zeros(post_cov);
+	numa_record_array("post_mean", post_mean.memptr(), post_mean.n_elem * sizeof(double));
+	numa_record_array("post_cov", post_cov.memptr(), post_cov.n_elem * sizeof(double));
+}
+};
+
+// POSTERIORSAMPLER CLASS
+// ----------------------
+// @title Streaming summaries of posterior samples
+// @description Draws M samples from the posterior mixture of each effect
+// and folds them into summaries as they are drawn, so that memory is
+// O(J x Q + Q x Q) however large M is. The arguments are as for
+// PosteriorMASH.
+class PosteriorSampler
+{
+public:
+PosteriorSampler(const mat &  b_mat,
+                 const mat &  s_mat,
+                 const mat &  s_alpha_mat,
+                 const mat &  s_orig_mat,
+                 const mat &  v_mat,
+                 const mat &  l_mat,
+                 const mat &  a_mat,
+                 const cube & U_cube) :
+	b_mat(b_mat), v_mat(v_mat), l_mat(l_mat), a_mat(a_mat), U_cube(U_cube)
+{
+	int J = b_mat.n_cols, R = b_mat.n_rows;
+
+	if (s_mat.is_empty()) s_obj.set(R, J);
+	else s_obj.set(s_mat, s_alpha_mat);
+	s_obj.set_original(s_orig_mat);
+	#ifdef _OPENMP
+	omp_set_num_threads(1);
+	#endif
+}
+
+~PosteriorSampler(){
+}
+
+// @title Sample from the posterior and summarise the samples
+// @param posterior_weights P X J matrix, the posterior probabilities of each mixture component for each effect
+// @param n_samples number of samples M to draw for each effect
+// @param seed random number seed; effect j uses its own generator seeded
+// with (seed, j), so the result does not depend on the number of threads
+// @param probs quantiles to report for each effect and condition
+// @param factor samples are shared between two conditions when their ratio is within [factor, 1/factor]
+// @param lfsr_thresh pairs of conditions are counted for an effect when it is significant in either
+// @param fun_type transform applied before sharing ratios: 0 identity, 1 abs, 2 exp
+int
+sample(const mat & posterior_weights, const uword & n_samples,
+       const uword & seed, const vec & probs, const double & factor,
+       const double & lfsr_thresh, const int & fun_type)
+{
+	return mash_sample_posterior(b_mat, s_obj, v_mat, l_mat, m_mat, a_mat,
+	                             U_cube, posterior_weights, n_samples, seed,
+	                             probs, factor, lfsr_thresh, fun_type,
+	                             quantiles, neg_freq, pos_freq, share_num,
+	                             share_den);
+}
+
+// R X J missingness mask, non-zero for missing measurements
+int
+set_missing(const mat & value)
+{
+	m_mat = value;
+	return 0;
+}
+
+int
+set_thread(const int & value)
+{
+	#ifdef _OPENMP
+	omp_set_num_threads(value);
+	#endif
+	return 0;
+}
+
+// @return Quantiles J x Q x K array of sample quantiles
+// @return NegativeFreq J x Q matrix, fraction of samples below zero
+// @return PositiveFreq J x Q matrix, fraction of samples above zero
+// @return SharingCounts Q x Q matrix, summed over effects of the fraction of samples shared
+// @return SharingEffects Q x Q matrix, number of effects counted for each pair
+const cube &
+Quantiles() const {
+	return quantiles;
+}
+
+const mat &
+NegativeFreq() const {
+	return neg_freq;
+}
+
+const mat &
+PositiveFreq() const {
+	return pos_freq;
+}
+
+const mat &
+SharingCounts() const {
+	return share_num;
+}
+
+const mat &
+SharingEffects() const {
+	return share_den;
+}
+
+private:
+// input
+mat b_mat;
+SE s_obj;
+mat v_mat;
+mat l_mat;
+mat a_mat;
+mat m_mat;
+cube U_cube;
+// output
+cube quantiles;
+mat neg_freq;
+mat pos_freq;
+mat share_num;
+mat share_den;
 };
 
 // POSTERIORASH CLASS
@@ -842,7 +1301,9 @@ fit(const int & maxiter, const double & converge_tol, const double & eigen_tol,
 	unsigned int n = X_mat.n_rows;
 	unsigned int k = w_vec.size();
 
+	progress_expect(maxiter);
 	for (unsigned int iter = 0; iter < (unsigned int) maxiter; ++iter) {
+		if (progress_cancelled()) break;
 		// store parameters and likelihood in the previous step
 		vec w0_vec = w_vec;
 
@@ -877,6 +1338,7 @@ fit(const int & maxiter, const double & converge_tol, const double & eigen_tol,
 		maxd(iter)      = d;
 		objective(iter) = f;
 		iter_out        = iter;
+		progress_tick();
 
 		if (d < converge_tol) {
 			break;
@@ -909,12 +1371,72 @@ compute_loglik()
 
 // FUNCTION DEFINITIONS
 // --------------------
+// @title calc_lik for a group of effects
+// @description fills the rows of lik for effects that share the covariance
+// sigma; the likelihood is marginalised to the observed conditions of the
+// group. The missing conditions are encoded with a very large standard error
+// (see set_data), under which they add log N(0; ., S_m V_m.o S_m) to the
+// joint log-likelihood, V_m.o being the conditional covariance of V on the
+// missing given the observed conditions; that constant is added back, so
+// the log-likelihood is comparable to evaluating the encoded data directly.
+// It does not depend on the prior, and so not on the mixture weights.
+// @param s_mat R by J standard errors, giving those of the missing conditions
+// @param parallel if false the components are done on the calling thread
+inline void
+calc_lik_group(const mat &         b_mat,
+               const mat &         s_mat,
+               const mat &         sigma,
+               const EffectGroup & group,
+               const cube &        U_cube,
+               bool                logd,
+               mat &               lik,
+               bool                parallel = true)
+{
+	uvec obs = group.obs;
+	uvec idx = group.effects;
+
+	// log-likelihood of the missing conditions, per effect
+	vec miss_lik(idx.n_elem, arma::fill::zeros);
+	if (obs.n_elem < sigma.n_rows) {
+		uvec observed(sigma.n_rows, arma::fill::zeros);
+		observed.elem(obs).ones();
+		uvec miss = find(observed == 0);
+		// sigma = S V S, so its conditional covariance is S_m V_m.o S_m
+		mat cond = sigma.submat(miss, miss);
+		if (obs.n_elem > 0)
+			cond -= sigma.submat(miss, obs) * solve(sigma.submat(obs, obs), sigma.submat(obs, miss));
+		double val, sign;
+		log_det(val, sign, cond);
+		vec log_s0 = log(s_mat.submat(miss, idx.subvec(0, 0)));
+		for (uword k = 0; k < idx.n_elem; ++k)
+			miss_lik.at(k) = -0.5 * (miss.n_elem * LOG_2PI + val)
+			                 - accu(log(s_mat.submat(miss, idx.subvec(k, k))) - log_s0);
+	}
+	if (obs.n_elem == 0) {
+		for (uword k = 0; k < idx.n_elem; ++k)
+			lik.row(idx.at(k)).fill(logd ? miss_lik.at(k) : std::exp(miss_lik.at(k)));
+		return;
+	}
+	mat b_o     = b_mat.submat(obs, idx);
+	mat sigma_o = sigma.submat(obs, obs);
+	vec mean_o(obs.n_elem, arma::fill::zeros);
+	#pragma \
+	omp parallel for if(parallel) default(none) schedule(static) shared(lik, U_cube, mean_o, sigma_o, logd, b_o, obs, idx, miss_lik)
+	for (uword p = 0; p < lik.n_cols; ++p) {
+		vec lik_p = dmvnorm_mat(b_o, mean_o, sigma_o + U_cube.slice(p).submat(obs, obs), logd);
+		if (logd) lik_p += miss_lik;
+		else lik_p %= exp(miss_lik);
+		for (uword k = 0; k < idx.n_elem; ++k) lik.at(idx.at(k), p) = lik_p.at(k);
+	}
+}
+
 // @title calc_lik
 // @description computes matrix of likelihoods for each of J cols of Bhat for each of P prior covariances
 // @param b_mat R by J
 // @param s_mat R by J
 // @param v_mat R by R
-// @param l_mat R by R for the common baseline application (@Yuxin Zou)
+// @param l_mat Q by R for the common baseline application (@Yuxin Zou)
+// @param m_mat R by J missingness mask, non-zero for missing measurements; may be empty
 // @param U_cube list of prior covariance matrices
 // @param sigma_cube list of sigma which is result of get_cov(s_mat, v_mat, l_mat)
 // @param logd if true computes log-likelihood
@@ -925,6 +1447,7 @@ calc_lik(const mat &  b_mat,
          const mat &  s_mat,
          const mat &  v_mat,
          const mat &  l_mat,
+         const mat &  m_mat,
          const cube & U_cube,
          const cube & sigma_cube,
          bool         logd,
@@ -934,28 +1457,98 @@ calc_lik(const mat &  b_mat,
 	// In armadillo data are stored with column-major ordering
 	// slicing columns are therefore faster than rows
 	// lik is a J by P matrix
-	mat lik(b_mat.n_cols, U_cube.n_slices, arma::fill::zeros);
+	mat lik;
 	vec mean(b_mat.n_rows, arma::fill::zeros);
 	mat sigma;
     #ifdef _OPENMP
 	omp_set_num_threads(n_thread);
     #endif
-	if (common_cov) {
+	bool grouped = !m_mat.is_empty() || (!common_cov && !l_mat.is_empty() && sigma_cube.is_empty());
+	// the common covariance version splits the columns between threads
+	numa_zeros(lik, b_mat.n_cols, U_cube.n_slices, common_cov && !grouped);
+	numa_record_array("lik", lik.memptr(), lik.n_elem * sizeof(double));
+	progress_expect((unsigned long long) lik.n_rows * lik.n_cols);
+	if (grouped) {
+		// effects sharing their observed conditions and standard errors
+		// share the covariance, so each factorisation is done once per group
+		Contrast contrast(l_mat);
+		std::vector<EffectGroup> groups = group_effects(s_mat, m_mat, b_mat.n_rows);
+		std::vector<size_t> small;
+		for (size_t g = 0; g < groups.size(); ++g) {
+			if (groups[g].effects.n_elem < LARGE_GROUP) {
+				small.push_back(g);
+				continue;
+			}
+			if (progress_cancelled()) break;
+			calc_lik_group(b_mat, s_mat, get_cov(s_mat.col(groups[g].effects.at(0)), v_mat, contrast),
+			               groups[g], U_cube, logd, lik);
+			progress_tick(groups[g].effects.n_elem * lik.n_cols);
+		}
+	#pragma omp parallel for default(none) schedule(dynamic) shared(b_mat, s_mat, v_mat, contrast, groups, small, U_cube, logd, lik)
+		for (size_t k = 0; k < small.size(); ++k) {
+			if (progress_cancelled()) continue;
+			const EffectGroup & group = groups[small[k]];
+			calc_lik_group(b_mat, s_mat, get_cov(s_mat.col(group.effects.at(0)), v_mat, contrast),
+			               group, U_cube, logd, lik);
+			progress_tick(group.effects.n_elem * lik.n_cols);
+		}
+	} else if (common_cov) {
 		if (!sigma_cube.is_empty()) sigma = sigma_cube.slice(0);
 		else sigma = get_cov(s_mat.col(0), v_mat, l_mat);
 	#pragma omp parallel for default(none) schedule(static) shared(lik, U_cube, mean, sigma, logd, b_mat)
 		for (uword p = 0; p < lik.n_cols; ++p) {
+			if (progress_cancelled()) continue;
 			lik.col(p) = dmvnorm_mat(b_mat, mean, sigma + U_cube.slice(p), logd);
+			progress_tick(lik.n_rows);
 		}
 	} else {
 	#pragma \
 		omp parallel for default(none) schedule(static) shared(lik, mean, logd, U_cube, b_mat, sigma_cube, l_mat, v_mat, s_mat) private(sigma)
 		for (uword j = 0; j < lik.n_rows; ++j) {
+			if (progress_cancelled()) continue;
 			if (!sigma_cube.is_empty()) sigma = sigma_cube.slice(j);
 			else sigma = get_cov(s_mat.col(j), v_mat, l_mat);
 			for (uword p = 0; p < lik.n_cols; ++p) {
 				lik.at(j, p) = dmvnorm(b_mat.col(j), mean, sigma + U_cube.slice(p), logd);
 			}
+			progress_tick(lik.n_cols);
+		}
+	}
+	return lik;
+}
+
+// @title calc_lik for one of many small problems
+// @description the log-likelihoods of calc_lik, computed on the calling
+// thread. It leaves the number of threads, the NUMA placement and the
+// progress alone, so it can run in the parallel region of fit_mash_batch,
+// which sets them up once for the whole batch.
+// @param m_mat R by J missingness mask, non-zero for missing measurements; may be empty
+// @param common_cov if true all effects share their covariance
+// @return J x P matrix of log-likelihoods
+inline mat
+calc_lik_problem(const mat &  b_mat,
+                 const mat &  s_mat,
+                 const mat &  v_mat,
+                 const mat &  m_mat,
+                 const cube & U_cube,
+                 bool         common_cov)
+{
+	mat lik(b_mat.n_cols, U_cube.n_slices);
+	vec mean(b_mat.n_rows, arma::fill::zeros);
+	if (!m_mat.is_empty()) {
+		std::vector<EffectGroup> groups = group_effects(s_mat, m_mat, b_mat.n_rows);
+		for (size_t g = 0; g < groups.size(); ++g)
+			calc_lik_group(b_mat, s_mat, get_cov(s_mat.col(groups[g].effects.at(0)), v_mat),
+			               groups[g], U_cube, true, lik, false);
+	} else if (common_cov) {
+		mat sigma = get_cov(s_mat.col(0), v_mat);
+		for (uword p = 0; p < lik.n_cols; ++p)
+			lik.col(p) = dmvnorm_mat(b_mat, mean, sigma + U_cube.slice(p), true);
+	} else {
+		for (uword j = 0; j < lik.n_rows; ++j) {
+			mat sigma = get_cov(s_mat.col(j), v_mat);
+			for (uword p = 0; p < lik.n_cols; ++p)
+				lik.at(j, p) = dmvnorm(b_mat.col(j), mean, sigma + U_cube.slice(p), true);
 		}
 	}
 	return lik;
@@ -983,7 +1576,9 @@ calc_lik(const mat & b_mat,
 
 	if (common_cov) P = rooti_cube.n_slices;
 	else P = rooti_cube.n_slices / b_mat.n_cols;
-	mat lik(b_mat.n_cols, P, arma::fill::zeros);
+	mat lik;
+	numa_zeros(lik, b_mat.n_cols, P, common_cov);
+	numa_record_array("lik", lik.memptr(), lik.n_elem * sizeof(double));
 	vec mean(b_mat.n_rows, arma::fill::zeros);
 	if (common_cov) {
 	#pragma omp parallel for default(none) schedule(static) shared(lik, mean, logd, rooti_cube, b_mat)
@@ -1026,92 +1621,543 @@ calc_lik(const vec & b_vec,
 	return lik;
 }
 
-// This implements the core part of the compute_posterior method in
-// the PosteriorMASH class.
+// @title Batch precomputation of factors
+// @description computes, in parallel, the quantities that can be supplied to
+// calc_lik and to the MVSERMix class in place of V and U:
+// Vinv = (S V S)^{-1}, rooti = t(chol(S V S + U)^{-1}), U0 = U (Vinv U + I)^{-1}
+// and Uinv = U^{-1}. Failures (e.g. a singular prior U) do not throw; the
+// slice is filled with NaN and flagged in the corresponding status vector.
+// @param s_mat R by J
+// @param v_mat R by R
+// @param U_cube R by R by P
+// @param common_cov if true all J columns of s_mat are the same and only the first is used
+// @param vinv_cube R by R by J, or R by R by 1 if common_cov
+// @param rooti_cube R by R by J*P (slice j*P+p), or R by R by P if common_cov
+// @param U0_cube R by R by J*P (slice j*P+p), or R by R by P if common_cov
+// @param Uinv_cube R by R by P
+// @return the number of failed slices
 int
-mash_compute_posterior(const mat& b_mat, const SE& s_obj,
-                       const mat& v_mat, const mat& l_mat,
-                       const mat& a_mat, const cube& U_cube,
-                       const cube& Vinv_cube,
-                       const cube& U0_cube, mat& post_mean,
-                       mat& post_var, mat& neg_prob,
-                       mat& zero_prob, cube& post_cov,
-                       const mat& posterior_weights,
-                       const int& report_type)
+precompute_factors(const mat &  s_mat,
+                   const mat &  v_mat,
+                   const cube & U_cube,
+                   bool         common_cov,
+                   cube &       vinv_cube,
+                   cube &       rooti_cube,
+                   cube &       U0_cube,
+                   cube &       Uinv_cube,
+                   uvec &       vinv_status,
+                   uvec &       rooti_status,
+                   uvec &       U0_status,
+                   uvec &       Uinv_status)
 {
-	vec mean(post_mean.n_rows);
-	mean.fill(0);
-
-    #pragma \
-	omp parallel for schedule(static) default(none) shared(posterior_weights, report_type, mean, post_mean, post_var, neg_prob, zero_prob, post_cov, b_mat, s_obj, l_mat, v_mat, a_mat, U_cube, Vinv_cube, U0_cube)
-	for (uword j = 0; j < post_mean.n_cols; ++j) {
-		// FIXME: improved math may help here
-		mat Vinv_j;
-		if (Vinv_cube.is_empty())
-			Vinv_j = inv_sympd(get_cov(s_obj.get_original().col(j),
-			                           v_mat, l_mat));
-		else
-			Vinv_j = Vinv_cube.slice(j);
+	uword R = v_mat.n_rows;
+	uword J = common_cov ? 1 : s_mat.n_cols;
+	uword P = U_cube.n_slices;
+
+	vinv_cube.set_size(R, R, J);
+	rooti_cube.set_size(R, R, J * P);
+	U0_cube.set_size(R, R, J * P);
+	Uinv_cube.set_size(R, R, P);
+	vinv_status.zeros(J);
+	rooti_status.zeros(J * P);
+	U0_status.zeros(J * P);
+	Uinv_status.zeros(P);
+
+	#pragma omp parallel for schedule(static) default(none) shared(J, s_mat, v_mat, vinv_cube, vinv_status)
+	for (uword j = 0; j < J; ++j) {
+		if (!inv_sympd(vinv_cube.slice(j), get_cov(s_mat.col(j), v_mat))) {
+			vinv_cube.slice(j).fill(datum::nan);
+			vinv_status.at(j) = 1;
+		}
+	}
+	#pragma omp parallel for schedule(static) default(none) shared(P, U_cube, Uinv_cube, Uinv_status)
+	for (uword p = 0; p < P; ++p) {
+		if (!inv_sympd(Uinv_cube.slice(p), U_cube.slice(p))) {
+			Uinv_cube.slice(p).fill(datum::nan);
+			Uinv_status.at(p) = 1;
+		}
+	}
+	#pragma omp parallel for schedule(static) default(none) shared(J, P, R, s_mat, v_mat, U_cube, vinv_cube, vinv_status, rooti_cube, rooti_status, U0_cube, U0_status)
+	for (uword k = 0; k < J * P; ++k) {
+		uword j = k / P, p = k % P;
+		mat L, Li, S;
+		// rooti
+		if (chol(L, get_cov(s_mat.col(j), v_mat) + U_cube.slice(p))
+		    && inv(Li, trimatu(L))) {
+			rooti_cube.slice(k) = Li.t();
+		} else {
+			rooti_cube.slice(k).fill(datum::nan);
+			rooti_status.at(k) = 1;
+		}
+		// U0
+		S = vinv_cube.slice(j) * U_cube.slice(p);
+		S.diag() += 1.0;
+		if (vinv_status.at(j) == 0 && inv(Li, S)) {
+			U0_cube.slice(k) = U_cube.slice(p) * Li;
+		} else {
+			U0_cube.slice(k).fill(datum::nan);
+			U0_status.at(k) = 1;
+		}
+	}
+	return accu(vinv_status) + accu(rooti_status) + accu(U0_status) + accu(Uinv_status);
+} // precompute_factors
+
+// POSTERIOR KERNELS
+// -----------------
+// mash_compute_posterior, mash_compute_posterior_comcov and
+// mash_compute_posterior_grouped decide once per call, rather than for
+// every effect and component, what their inner loops have to do: each
+// runs a kernel templated on the policies below, picked by
+// dispatch_transform from the inputs and report_type.
+
+// The inputs and outputs of the posterior kernels; contrast is built
+// from l_mat once
+struct PosteriorArgs
+{
+	const mat &      b_mat;
+	const SE &       s_obj;
+	const mat &      v_mat;
+	const Contrast & contrast;
+	const mat &      m_mat;
+	const mat &      a_mat;
+	const cube &     U_cube;
+	const cube &     Vinv_cube;
+	const cube &     U0_cube;
+	mat &            post_mean;
+	mat &            post_var;
+	mat &            neg_prob;
+	mat &            zero_prob;
+	cube &           post_cov;
+	const mat &      posterior_weights;
+};
 
-		// R X P matrices
-		mat mu1_mat(post_mean.n_rows, U_cube.n_slices);
-		mat diag_mu2_mat(post_mean.n_rows, U_cube.n_slices);
-		mat zero_mat(post_mean.n_rows, U_cube.n_slices);
-		mat neg_mat(post_mean.n_rows, U_cube.n_slices);
+// @title The outputs of a report_type
+// @description 1 the posterior mean only; 2 adds the variance and the
+// second moment matrix; 3 the default mash output, the mean, variance,
+// and negative and zero probabilities; 4 adds the posterior covariance.
+// Outputs not computed are left as place() zeroed them.
+template <int ReportType>
+struct PosteriorOutputs
+{
+	static const bool var   = ReportType != 1;
+	static const bool probs = ReportType >= 3;
+	static const bool cov   = ReportType == 2 || ReportType == 4;
+	// the covariance rather than the second moment
+	static const bool centred = ReportType == 4;
+};
 
-		mu1_mat.fill(0);
-		diag_mu2_mat.fill(0);
-		zero_mat.fill(0);
+// @title Posterior summaries of A b rather than b, when a_mat is given
+template <bool Present>
+struct PosteriorTransform
+{
+	template <typename T>
+	static void
+	mean(const mat & a_mat, T & mu1)
+	{
+		if (Present) mu1 = a_mat * mu1;
+	}
 
-		for (uword p = 0; p < U_cube.n_slices; ++p) {
-			//
-			mat U1(post_mean.n_rows, post_mean.n_rows);
-			mat U0;
-			U1.fill(0);
-
-			if (U0_cube.is_empty())
-				U0 = get_posterior_cov(Vinv_j, U_cube.slice(p));
-			else
-				U0 = U0_cube.slice(j * U_cube.n_slices + p);
-			if (a_mat.is_empty()) {
-				mu1_mat.col(p) = get_posterior_mean(b_mat.col(j), Vinv_j, U0) % s_obj.get().col(j);
-				U1 = (U0.each_col() % s_obj.get().col(j)).each_row() % s_obj.get().col(j).t();
-			} else {
-				mu1_mat.col(p) = a_mat * (get_posterior_mean(b_mat.col(j), Vinv_j, U0) % s_obj.get().col(j));
-				U1 = a_mat * (((U0.each_col() % s_obj.get().col(j)).each_row() % s_obj.get().col(j).t()) * a_mat.t());
-			}
+	static void
+	cov(const mat & a_mat, mat & U1)
+	{
+		if (Present) U1 = a_mat * U1 * a_mat.t();
+	}
+};
 
-			if (report_type == 2 || report_type == 4) {
-				post_cov.slice(j) += posterior_weights.at(p, j) * (U1 + mu1_mat.col(p) * mu1_mat.col(p).t());
-			}
+// where the inverse error covariance of effect j comes from: the given
+// Vinv_cube, or S V S, or L S V S L' for the common baseline
+const int VINV_GIVEN    = 0;
+const int VINV_SVS      = 1;
+const int VINV_CONTRAST = 2;
 
-			vec sigma = sqrt(U1.diag()); // U1.diag() is the posterior covariance
-			diag_mu2_mat.col(p) = pow(mu1_mat.col(p), 2.0) + U1.diag();
-			neg_mat.col(p)      = pnorm(mu1_mat.col(p), mean, sigma);
-			for (uword r = 0; r < sigma.n_elem; ++r) {
-				if (sigma.at(r) == 0) {
-					zero_mat.at(r, p) = 1.0;
-					neg_mat.at(r, p)  = 0.0;
-				}
-			}
-		}
+template <int Source>
+struct PosteriorVinv
+{
+	static mat
+	get(const PosteriorArgs & a, uword j)
+	{
+		if (Source == VINV_GIVEN) return a.Vinv_cube.slice(j);
+		vec s = a.s_obj.get_original().col(j);
+		if (Source == VINV_SVS) return inv_sympd(get_cov(s, a.v_mat));
+		return inv_sympd(get_cov(s, a.v_mat, a.contrast));
+	}
+};
 
-		// compute weighted means of posterior arrays
-		post_mean.col(j) = mu1_mat * posterior_weights.col(j);
-		post_var.col(j)  = diag_mu2_mat * posterior_weights.col(j);
-		neg_prob.col(j)  = neg_mat * posterior_weights.col(j);
-		zero_prob.col(j) = zero_mat * posterior_weights.col(j);
-		//
-		if (report_type == 4)
-			post_cov.slice(j) -= post_mean.col(j) * post_mean.col(j).t();
+// @title U0 of component p, from U0_cube (slice k) when it is given
+template <bool Given>
+struct PosteriorU0
+{
+	static mat
+	get(const PosteriorArgs & a, const mat & Vinv, uword k, uword p)
+	{
+		if (Given) return a.U0_cube.slice(k);
+		return get_posterior_cov(Vinv, a.U_cube.slice(p));
 	}
-	post_var -= pow(post_mean, 2.0);
+};
 
-	return 0;
-} // mash_compute_posterior
+// calls Kernel::run with the Policies followed by the outputs of
+// report_type
+template <class Kernel, class... Policies>
+int
+dispatch_outputs(const PosteriorArgs & a, int report_type)
+{
+	switch (report_type) {
+	case 1: return Kernel::template run<Policies..., PosteriorOutputs<1> >(a);
+	case 2: return Kernel::template run<Policies..., PosteriorOutputs<2> >(a);
+	case 4: return Kernel::template run<Policies..., PosteriorOutputs<4> >(a);
+	default: return Kernel::template run<Policies..., PosteriorOutputs<3> >(a);
+	}
+}
 
-// This implements the core part of the compute_posterior_comcov method in
-// the PosteriorMASH class.
+template <class Kernel, class... Policies>
+int
+dispatch_transform(const PosteriorArgs & a, int report_type)
+{
+	if (a.a_mat.is_empty())
+		return dispatch_outputs<Kernel, Policies..., PosteriorTransform<false> >(a, report_type);
+	return dispatch_outputs<Kernel, Policies..., PosteriorTransform<true> >(a, report_type);
+}
+
+// @title Posterior summaries, one effect at a time
+struct PosteriorEffectKernel
+{
+	template <class Vinv, class U0, class Transform, class Outputs>
+	static int
+	run(const PosteriorArgs & a)
+	{
+		const mat & w = a.posterior_weights;
+		uword Q = a.post_mean.n_rows, J = a.post_mean.n_cols, P = a.U_cube.n_slices;
+		vec mean(Q, arma::fill::zeros);
+		progress_expect(J);
+
+		#pragma \
+		omp parallel for schedule(static) default(none) shared(a, w, Q, J, P, mean)
+		for (uword j = 0; j < J; ++j) {
+			if (progress_cancelled()) continue;
+			// FIXME: improved math may help here
+			mat Vinv_j = Vinv::get(a, j);
+			vec b_j    = a.b_mat.col(j);
+			vec s_j    = a.s_obj.get().col(j);
+
+			// Q X P matrices
+			mat mu1_mat(Q, P);
+			mat diag_mu2_mat(Outputs::var ? Q : 0, P);
+			mat neg_mat(Outputs::probs ? Q : 0, P);
+			mat zero_mat(Outputs::probs ? Q : 0, P, arma::fill::zeros);
+
+			for (uword p = 0; p < P; ++p) {
+				mat U0_p = U0::get(a, Vinv_j, j * P + p, p);
+				vec mu1  = get_posterior_mean(b_j, Vinv_j, U0_p) % s_j;
+				Transform::mean(a.a_mat, mu1);
+				mu1_mat.col(p) = mu1;
+				if (!Outputs::var && !Outputs::cov) continue;
+
+				mat U1 = (U0_p.each_col() % s_j).each_row() % s_j.t();
+				Transform::cov(a.a_mat, U1);
+				if (Outputs::cov) a.post_cov.slice(j) += w.at(p, j) * (U1 + mu1 * mu1.t());
+				if (Outputs::var) diag_mu2_mat.col(p) = pow(mu1, 2.0) + U1.diag();
+				if (Outputs::probs) {
+					vec sigma = sqrt(U1.diag()); // U1.diag() is the posterior covariance
+					neg_mat.col(p) = pnorm(mu1, mean, sigma);
+					for (uword r = 0; r < sigma.n_elem; ++r) {
+						if (sigma.at(r) == 0) {
+							zero_mat.at(r, p) = 1.0;
+							neg_mat.at(r, p)  = 0.0;
+						}
+					}
+				}
+			}
+
+			// compute weighted means of posterior arrays
+			a.post_mean.col(j) = mu1_mat * w.col(j);
+			if (Outputs::var)
+				a.post_var.col(j) = diag_mu2_mat * w.col(j) - pow(a.post_mean.col(j), 2.0);
+			if (Outputs::probs) {
+				a.neg_prob.col(j)  = neg_mat * w.col(j);
+				a.zero_prob.col(j) = zero_mat * w.col(j);
+			}
+			if (Outputs::centred)
+				a.post_cov.slice(j) -= a.post_mean.col(j) * a.post_mean.col(j).t();
+			progress_tick();
+		}
+		return 0;
+	}
+};
+
+// @title Posterior summaries of effects sharing their error covariance
+// @description the per-component quantities are computed once; the
+// effects are then processed in blocks sized to stay in cache, with all
+// components applied to a block before moving on to the next one, so
+// that transient memory is O(R x block) per thread and the accumulations
+// are done on cache resident data without any critical section. Vinv and
+// U0 are only needed once per call, so they are not policies here.
+struct PosteriorComcovKernel
+{
+	template <class Transform, class Outputs>
+	static int
+	run(const PosteriorArgs & a)
+	{
+		uword Q = a.post_mean.n_rows;
+		uword J = a.post_mean.n_cols;
+		uword P = a.U_cube.n_slices;
+		const mat & w = a.posterior_weights;
+
+		// R X R
+		mat Vinv;
+		if (a.Vinv_cube.is_empty())
+			Vinv = inv_sympd(get_cov(a.s_obj.get_original().col(0), a.v_mat, a.contrast));
+		else Vinv = a.Vinv_cube.slice(0);
+
+		// for each component: R X R map from bhat to the (unscaled) posterior
+		// mean, Q X Q posterior covariance and its Q diagonal standard deviations
+		cube gain_cube(a.b_mat.n_rows, a.b_mat.n_rows, P);
+		cube U1_cube(Q, Q, P);
+		mat sd_mat(Q, P);
+		vec s0 = a.s_obj.get().col(0);
+
+		#pragma omp parallel for schedule(static) default(none) shared(a, P, Vinv, s0, gain_cube, U1_cube, sd_mat)
+		for (uword p = 0; p < P; ++p) {
+			mat U0 = a.U0_cube.is_empty() ? get_posterior_cov(Vinv, a.U_cube.slice(p))
+			                              : mat(a.U0_cube.slice(p));
+			gain_cube.slice(p) = U0 * Vinv;
+			mat U1 = (U0.each_col() % s0).each_row() % s0.t();
+			Transform::cov(a.a_mat, U1);
+			U1_cube.slice(p) = U1;
+			sd_mat.col(p)    = sqrt(U1.diag()); // U1.diag() is the posterior covariance
+		}
+
+		uword block   = get_block_size(a.b_mat.n_rows + Q);
+		uword nblocks = (J + block - 1) / block;
+		progress_expect(J);
+
+		#pragma \
+		omp parallel for schedule(static) default(none) shared(a, w, Q, J, P, block, nblocks, gain_cube, U1_cube, sd_mat)
+		for (uword k = 0; k < nblocks; ++k) {
+			if (progress_cancelled()) continue;
+			uword j0 = k * block;
+			uword j1 = std::min(J, j0 + block) - 1;
+			uword nj = j1 - j0 + 1;
+			// R X block
+			mat b_block = a.b_mat.cols(j0, j1);
+			mat s_block = a.s_obj.get().cols(j0, j1);
+			// P X block
+			mat w_block = w.cols(j0, j1);
+			// Q X block accumulators
+			mat mean_acc(Q, nj, arma::fill::zeros);
+			mat mu2_acc(Outputs::var ? Q : 0, nj, arma::fill::zeros);
+			mat neg_acc(Outputs::probs ? Q : 0, nj, arma::fill::zeros);
+			mat zero_acc(Outputs::probs ? Q : 0, nj, arma::fill::zeros);
+			mat mean(Outputs::probs ? Q : 0, nj, arma::fill::zeros);
+			mat sigma(Outputs::probs ? Q : 0, nj);
+
+			for (uword p = 0; p < P; ++p) {
+				rowvec w_p = w_block.row(p);
+				// Q X block
+				mat mu1_mat = (gain_cube.slice(p) * b_block) % s_block;
+				Transform::mean(a.a_mat, mu1_mat);
+				const mat & U1 = U1_cube.slice(p);
+
+				mean_acc += mu1_mat.each_row() % w_p;
+				if (Outputs::var) {
+					mat diag_mu2_mat = pow(mu1_mat, 2.0);
+					diag_mu2_mat.each_col() += U1.diag();
+					mu2_acc += diag_mu2_mat.each_row() % w_p;
+				}
+				if (Outputs::probs) {
+					sigma.each_col() = sd_mat.col(p);
+					mat neg_mat = pnorm(mu1_mat, mean, sigma);
+					for (uword r = 0; r < Q; ++r) {
+						if (sd_mat.at(r, p) == 0) {
+							zero_acc.row(r) += w_p;
+							neg_mat.row(r).zeros();
+						}
+					}
+					neg_acc += neg_mat.each_row() % w_p;
+				}
+				if (Outputs::cov) {
+					for (uword i = 0; i < nj; ++i) {
+						a.post_cov.slice(j0 + i) +=
+							w_p.at(i) * (U1 + mu1_mat.col(i) * mu1_mat.col(i).t());
+					}
+				}
+			}
+			a.post_mean.cols(j0, j1) = mean_acc;
+			if (Outputs::var) a.post_var.cols(j0, j1) = mu2_acc - pow(mean_acc, 2.0);
+			if (Outputs::probs) {
+				a.neg_prob.cols(j0, j1)  = neg_acc;
+				a.zero_prob.cols(j0, j1) = zero_acc;
+			}
+			if (Outputs::centred) {
+				for (uword i = 0; i < nj; ++i)
+					a.post_cov.slice(j0 + i) -= mean_acc.col(i) * mean_acc.col(i).t();
+			}
+			progress_tick(nj);
+		}
+		return 0;
+	}
+};
+
+// @title Posterior summaries for one effect
+// @description adds the posterior of effect j to the outputs, from the
+// factors K_cube and U0_cube of get_missing_factors for its observed
+// conditions obs, computing only what the Transform and Outputs policies
+// ask for
+template <class Transform, class Outputs>
+inline void
+mash_posterior_effect(uword        j,
+                      const mat &  b_mat,
+                      const SE &   s_obj,
+                      const mat &  a_mat,
+                      const uvec & obs,
+                      const cube & K_cube,
+                      const cube & U0_cube,
+                      mat &        post_mean,
+                      mat &        post_var,
+                      mat &        neg_prob,
+                      mat &        zero_prob,
+                      cube &       post_cov,
+                      const mat &  posterior_weights)
+{
+	uword Q = post_mean.n_rows, P = K_cube.n_slices;
+	vec mean(Q, arma::fill::zeros);
+	vec b_j = b_mat.col(j);
+	vec b_o = b_j.elem(obs);
+	vec s_j = s_obj.get().col(j);
+
+	// Q X P matrices
+	mat mu1_mat(Q, P);
+	mat diag_mu2_mat(Outputs::var ? Q : 0, P);
+	mat neg_mat(Outputs::probs ? Q : 0, P);
+	mat zero_mat(Outputs::probs ? Q : 0, P, arma::fill::zeros);
+
+	for (uword p = 0; p < P; ++p) {
+		vec mu1 = (K_cube.slice(p).t() * b_o) % s_j;
+		Transform::mean(a_mat, mu1);
+		mu1_mat.col(p) = mu1;
+		if (!Outputs::var && !Outputs::cov) continue;
+
+		mat U1 = (U0_cube.slice(p).each_col() % s_j).each_row() % s_j.t();
+		Transform::cov(a_mat, U1);
+		if (Outputs::cov) post_cov.slice(j) += posterior_weights.at(p, j) * (U1 + mu1 * mu1.t());
+		if (Outputs::var) diag_mu2_mat.col(p) = pow(mu1, 2.0) + U1.diag();
+		if (Outputs::probs) {
+			vec sigma = sqrt(U1.diag()); // U1.diag() is the posterior covariance
+			neg_mat.col(p) = pnorm(mu1, mean, sigma);
+			for (uword r = 0; r < sigma.n_elem; ++r) {
+				if (sigma.at(r) == 0) {
+					zero_mat.at(r, p) = 1.0;
+					neg_mat.at(r, p)  = 0.0;
+				}
+			}
+		}
+	}
+
+	// compute weighted means of posterior arrays
+	post_mean.col(j) = mu1_mat * posterior_weights.col(j);
+	if (Outputs::var)
+		post_var.col(j) = diag_mu2_mat * posterior_weights.col(j) - pow(post_mean.col(j), 2.0);
+	if (Outputs::probs) {
+		neg_prob.col(j)  = neg_mat * posterior_weights.col(j);
+		zero_prob.col(j) = zero_mat * posterior_weights.col(j);
+	}
+	if (Outputs::centred)
+		post_cov.slice(j) -= post_mean.col(j) * post_mean.col(j).t();
+}
+
+// @title Posterior summaries of effects grouped by their observed conditions
+// @description with missing measurements each effect is marginalised to
+// its observed conditions (see get_missing_factors), and effects with the
+// same observed conditions and standard errors share the factorisations.
+// This is also how repeated rows of Shat_orig are exploited for
+// contrasts, where the covariance is L %*% SVS %*% t(L). Vinv_cube and
+// U0_cube are not used.
+struct PosteriorGroupedKernel
+{
+	template <class Transform, class Outputs>
+	static int
+	run(const PosteriorArgs & a)
+	{
+		std::vector<EffectGroup> groups = group_effects(a.s_obj.get_original(), a.m_mat,
+		                                                a.b_mat.n_rows);
+		std::vector<size_t> small;
+		progress_expect(a.post_mean.n_cols);
+
+		for (size_t g = 0; g < groups.size(); ++g) {
+			if (groups[g].effects.n_elem < LARGE_GROUP) {
+				small.push_back(g);
+				continue;
+			}
+			if (progress_cancelled()) break;
+			uvec obs = groups[g].obs;
+			uvec idx = groups[g].effects;
+			// |o| X R X P and R X R X P
+			cube K_cube, U0_cube;
+			get_missing_factors(get_cov(a.s_obj.get_original().col(idx.at(0)), a.v_mat, a.contrast),
+			                    obs, a.U_cube, K_cube, U0_cube);
+			#pragma omp parallel for schedule(static) default(none) shared(a, obs, idx, K_cube, U0_cube)
+			for (uword k = 0; k < idx.n_elem; ++k) {
+				mash_posterior_effect<Transform, Outputs>(
+					idx.at(k), a.b_mat, a.s_obj, a.a_mat, obs, K_cube, U0_cube, a.post_mean,
+					a.post_var, a.neg_prob, a.zero_prob, a.post_cov, a.posterior_weights);
+			}
+			progress_tick(idx.n_elem);
+		}
+		#pragma omp parallel for schedule(dynamic) default(none) shared(a, groups, small)
+		for (size_t k = 0; k < small.size(); ++k) {
+			if (progress_cancelled()) continue;
+			const EffectGroup & group = groups[small[k]];
+			cube K_cube, U0_cube;
+			get_missing_factors(get_cov(a.s_obj.get_original().col(group.effects.at(0)), a.v_mat,
+			                            a.contrast),
+			                    group.obs, a.U_cube, K_cube, U0_cube);
+			for (uword i = 0; i < group.effects.n_elem; ++i) {
+				mash_posterior_effect<Transform, Outputs>(
+					group.effects.at(i), a.b_mat, a.s_obj, a.a_mat, group.obs, K_cube, U0_cube,
+					a.post_mean, a.post_var, a.neg_prob, a.zero_prob, a.post_cov,
+					a.posterior_weights);
+			}
+			progress_tick(group.effects.n_elem);
+		}
+		return 0;
+	}
+};
+
+// This implements the core part of the compute_posterior method in
+// the PosteriorMASH class.
+int
+mash_compute_posterior(const mat& b_mat, const SE& s_obj,
+                       const mat& v_mat, const mat& l_mat,
+                       const mat& a_mat, const cube& U_cube,
+                       const cube& Vinv_cube,
+                       const cube& U0_cube, mat& post_mean,
+                       mat& post_var, mat& neg_prob,
+                       mat& zero_prob, cube& post_cov,
+                       const mat& posterior_weights,
+                       const int& report_type)
+{
+	Contrast contrast(l_mat);
+	mat no_mask;
+	PosteriorArgs a = { b_mat, s_obj, v_mat, contrast, no_mask, a_mat, U_cube, Vinv_cube,
+		            U0_cube, post_mean, post_var, neg_prob, zero_prob, post_cov,
+		            posterior_weights };
+	typedef PosteriorEffectKernel K;
+	if (U0_cube.is_empty()) {
+		if (!Vinv_cube.is_empty())
+			return dispatch_transform<K, PosteriorVinv<VINV_GIVEN>, PosteriorU0<false> >(a, report_type);
+		if (l_mat.is_empty())
+			return dispatch_transform<K, PosteriorVinv<VINV_SVS>, PosteriorU0<false> >(a, report_type);
+		// effects with the same rows of Shat_orig share L S V S L'
+		return dispatch_transform<PosteriorGroupedKernel>(a, report_type);
+	}
+	if (!Vinv_cube.is_empty())
+		return dispatch_transform<K, PosteriorVinv<VINV_GIVEN>, PosteriorU0<true> >(a, report_type);
+	if (l_mat.is_empty())
+		return dispatch_transform<K, PosteriorVinv<VINV_SVS>, PosteriorU0<true> >(a, report_type);
+	return dispatch_transform<K, PosteriorVinv<VINV_CONTRAST>, PosteriorU0<true> >(a, report_type);
+} // mash_compute_posterior
+
+// This implements the core part of the compute_posterior_comcov method in
+// the PosteriorMASH class.
 int
 mash_compute_posterior_comcov(const mat&   b_mat,
                               const SE &   s_obj,
@@ -1129,87 +2175,1435 @@ mash_compute_posterior_comcov(const mat&   b_mat,
                               const mat &  posterior_weights,
                               const int &  report_type)
 {
-	mat mean(post_mean.n_rows, post_mean.n_cols);
-	mean.fill(0);
+	Contrast contrast(l_mat);
+	mat no_mask;
+	PosteriorArgs a = { b_mat, s_obj, v_mat, contrast, no_mask, a_mat, U_cube, Vinv_cube,
+		            U0_cube, post_mean, post_var, neg_prob, zero_prob, post_cov,
+		            posterior_weights };
+	return dispatch_transform<PosteriorComcovKernel>(a, report_type);
+} // mash_compute_posterior_comcov
 
-	// R X R
-	mat Vinv;
+// This implements the compute_posterior method in the PosteriorMASH class
+// when effects are grouped, by missing measurements or by repeated rows
+// of Shat_orig for contrasts; see PosteriorGroupedKernel.
+int
+mash_compute_posterior_grouped(const mat&   b_mat,
+                               const SE &   s_obj,
+                               const mat &  v_mat,
+                               const mat &  l_mat,
+                               const mat &  m_mat,
+                               const mat &  a_mat,
+                               const cube & U_cube,
+                               mat &        post_mean,
+                               mat &        post_var,
+                               mat &        neg_prob,
+                               mat &        zero_prob,
+                               cube &       post_cov,
+                               const mat &  posterior_weights,
+                               const int &  report_type)
+{
+	Contrast contrast(l_mat);
+	cube none;
+	PosteriorArgs a = { b_mat, s_obj, v_mat, contrast, m_mat, a_mat, U_cube, none, none,
+		            post_mean, post_var, neg_prob, zero_prob, post_cov, posterior_weights };
+	return dispatch_transform<PosteriorGroupedKernel>(a, report_type);
+} // mash_compute_posterior_grouped
+
+// @title Transform used for sharing ratios
+// @param fun_type 0 identity, 1 abs, 2 exp
+inline double
+sharing_transform(const double & x, const int & fun_type)
+{
+	if (fun_type == 1) return std::fabs(x);
+	if (fun_type == 2) return std::exp(x);
+	return x;
+}
 
-	if (Vinv_cube.is_empty())
-		Vinv =
-			inv_sympd(get_cov(s_obj.get_original().col(0), v_mat, l_mat));
-	else Vinv = Vinv_cube.slice(0);
+// @title Add the sharing of one effect to the pairwise sharing counts
+// @description for every pair q <= r of conditions where the effect is
+// significant in q or r, adds to share_num the fraction of the columns of
+// x (posterior samples, or the single posterior mean) whose ratio
+// x[q] / x[r] is within (factor, 1 / factor), and adds one to share_den.
+// Only the upper triangles are filled.
+// @param x Q x M transformed effects
+// @param sig Q indicators of significance
+// @param na_rm whether a NaN ratio is not counted, as in sum(..., na.rm = TRUE),
+// or makes the pair NaN, as in mean()
+inline void
+accumulate_sharing(const mat & x, const uvec & sig, const double & factor,
+                   const bool & na_rm, mat & share_num, mat & share_den)
+{
+	uword Q = x.n_rows, M = x.n_cols;
+
+	for (uword q = 0; q < Q; ++q) {
+		for (uword r = q; r < Q; ++r) {
+			if (!sig.at(q) && !sig.at(r)) continue;
+			double shared = 0;
+			for (uword m = 0; m < M; ++m) {
+				double ratio = x.at(q, m) / x.at(r, m);
+				if (ratio > factor && ratio < 1.0 / factor) ++shared;
+				else if (!na_rm && std::isnan(ratio)) shared = datum::nan;
+			}
+			share_num.at(q, r) += shared / M;
+			share_den.at(q, r) += 1;
+		}
+	}
+}
 
-	rowvec ones(post_mean.n_cols);
-	rowvec zeros(post_mean.n_cols);
-	ones.fill(1);
-	zeros.fill(0);
+// @title Per thread index into thread local accumulators
+inline int
+get_thread_id()
+{
+	#ifdef _OPENMP
+	return omp_get_thread_num();
+	#else
+	return 0;
+	#endif
+}
 
-    #pragma \
-	omp parallel for schedule(static) default(none) shared(posterior_weights, report_type, mean, Vinv, ones, zeros, post_mean, post_var, neg_prob, zero_prob, post_cov, b_mat, s_obj, a_mat, U_cube, U0_cube)
-	for (uword p = 0; p < U_cube.n_slices; ++p) {
-		mat zero_mat(post_mean.n_rows, post_mean.n_cols);
-		// R X R
-		mat U1(post_mean.n_rows, post_mean.n_rows);
-		// R X J
-		mat mu1_mat(post_mean.n_rows, post_mean.n_cols);
-		mat U0;
-		zero_mat.fill(0);
-		U1.fill(0);
-		mu1_mat.fill(0);
+inline int
+get_max_threads()
+{
+	#ifdef _OPENMP
+	return omp_get_max_threads();
+	#else
+	return 1;
+	#endif
+}
 
-		if (U0_cube.is_empty()) U0 = get_posterior_cov(Vinv, U_cube.slice(p));
-		else U0 = U0_cube.slice(p);
-		if (a_mat.is_empty()) {
-			mu1_mat = get_posterior_mean_mat(b_mat, Vinv, U0) % s_obj.get();
-			U1      = (U0.each_col() % s_obj.get().col(0)).each_row() % s_obj.get().col(0).t();
-		} else {
-			mu1_mat = a_mat * (get_posterior_mean_mat(b_mat, Vinv, U0) % s_obj.get());
-			U1      = a_mat
-			          * (((U0.each_col() % s_obj.get().col(0)).each_row() % s_obj.get().col(0).t())
-			             * a_mat.t());
+// @title Pairwise sharing of effects between conditions
+// @description This implements get_pairwise_sharing and
+// get_pairwise_sharing_from_samples in one blocked pass over the effects.
+// Each block of effects is copied from the J x Q x M array into Q x M
+// matrices reading contiguous runs of effects, and each thread
+// accumulates its own counts. The sharing matrix is share_num / share_den.
+// @param x_cube J x Q x M posterior means (M = 1) or posterior samples
+// @param lfsr_mat J x Q local false sign rates
+// @param fun_type transform applied before the ratios: 0 identity, 1 abs, 2 exp
+// @param na_rm see accumulate_sharing
+// @param share_num Q x Q output, summed over effects of the fraction shared
+// @param share_den Q x Q output, number of effects counted for each pair
+inline int
+pairwise_sharing(const cube & x_cube, const mat & lfsr_mat,
+                 const double & factor, const double & lfsr_thresh,
+                 const int & fun_type, const bool & na_rm,
+                 mat & share_num, mat & share_den)
+{
+	uword J = x_cube.n_rows, Q = x_cube.n_cols, M = x_cube.n_slices;
+	uword block = get_block_size(Q * M);
+	uword n_block = (J + block - 1) / block;
+	int n_thread = get_max_threads();
+	cube num_cube(Q, Q, n_thread, arma::fill::zeros);
+	cube den_cube(Q, Q, n_thread, arma::fill::zeros);
+	progress_expect(J);
+
+	#pragma \
+	omp parallel for schedule(dynamic) default(none) shared(x_cube, lfsr_mat, factor, lfsr_thresh, fun_type, na_rm, J, Q, M, block, n_block, num_cube, den_cube)
+	for (uword b = 0; b < n_block; ++b) {
+		if (progress_cancelled()) continue;
+		int t = get_thread_id();
+		uword j0 = b * block, j1 = std::min(J, j0 + block);
+		// Q x M x block copy of the effects in this block
+		cube x_block(Q, M, j1 - j0);
+		for (uword m = 0; m < M; ++m)
+			for (uword q = 0; q < Q; ++q) {
+				const double * x = x_cube.slice(m).colptr(q);
+				for (uword j = j0; j < j1; ++j)
+					x_block.at(q, m, j - j0) = sharing_transform(x[j], fun_type);
+			}
+		for (uword j = j0; j < j1; ++j) {
+			uvec sig = trans(lfsr_mat.row(j) < lfsr_thresh);
+			if (!arma::any(sig)) continue;
+			accumulate_sharing(x_block.slice(j - j0), sig, factor, na_rm,
+			                   num_cube.slice(t), den_cube.slice(t));
 		}
-		// R X J
-		mat diag_mu2_mat = pow(mu1_mat, 2.0);
-		diag_mu2_mat.each_col() += U1.diag();
-		// R X J
-		// FIXME: any better way to init sigma?
-		mat sigma(post_mean.n_rows, post_mean.n_cols);
-		sigma.fill(0);
+		progress_tick(j1 - j0);
+	}
+	share_num.zeros(Q, Q);
+	share_den.zeros(Q, Q);
+	for (int t = 0; t < n_thread; ++t) {
+		share_num += num_cube.slice(t);
+		share_den += den_cube.slice(t);
+	}
+	share_num = arma::symmatu(share_num);
+	share_den = arma::symmatu(share_den);
 
-		sigma.each_col() += sqrt(U1.diag()); // U1.diag() is the posterior covariance
-		mat neg_mat = pnorm(mu1_mat, mean, sigma);
-		for (uword r = 0; r < sigma.n_rows; ++r) {
-			if (sigma.at(r, 0) == 0) {
-				zero_mat.row(r) = ones;
-				neg_mat.row(r)  = zeros;
+	return 0;
+} // pairwise_sharing
+
+// @title Square roots of the posterior covariance factors
+// @description F_cube.slice(p) F_cube.slice(p)' = U0_cube.slice(p). U0 is
+// only positive semi-definite, so the roots come from the eigen
+// decomposition rather than a Cholesky factor. For effect j the posterior
+// covariance is U1 = A S U0 S A', S = diag(s_j), so A S F is a root of U1
+// and the roots are computed once per group of effects.
+inline void
+get_sqrt_factors(const cube & U0_cube, cube & F_cube)
+{
+	F_cube.set_size(U0_cube.n_rows, U0_cube.n_cols, U0_cube.n_slices);
+	vec lambda;
+	mat E;
+	for (uword p = 0; p < U0_cube.n_slices; ++p) {
+		eig_sym(lambda, E, U0_cube.slice(p));
+		lambda.transform([](double v) { return v > 0 ? std::sqrt(v) : 0.0; });
+		F_cube.slice(p) = E.each_row() % lambda.t();
+	}
+}
+
+// @title Sample the posterior of one effect and fold the samples into summaries
+// @description the posterior of effect j is the mixture over p of
+// N(mu1_p, U1_p), built from the factors of get_missing_factors for its
+// observed conditions obs, and the roots F_cube of get_sqrt_factors.
+// Samples are drawn into a Q x M scratch matrix, summarised and
+// discarded. share_num and share_den are the accumulators of the calling
+// thread.
+inline void
+mash_sample_effect(uword        j,
+                   const mat &  b_mat,
+                   const SE &   s_obj,
+                   const mat &  a_mat,
+                   const uvec & obs,
+                   const cube & K_cube,
+                   const cube & U0_cube,
+                   const cube & F_cube,
+                   const mat &  posterior_weights,
+                   const uword  n_samples,
+                   const uword  seed,
+                   const vec &  probs,
+                   const double factor,
+                   const double lfsr_thresh,
+                   const int    fun_type,
+                   cube &       quantiles,
+                   mat &        neg_freq,
+                   mat &        pos_freq,
+                   mat &        share_num,
+                   mat &        share_den)
+{
+	uword P = K_cube.n_slices, Q = neg_freq.n_cols;
+	vec b_j = b_mat.col(j);
+	vec b_o = b_j.elem(obs);
+	vec s_j = s_obj.get().col(j);
+	vec w   = posterior_weights.col(j);
+	vec mean(Q, arma::fill::zeros);
+
+	std::seed_seq seq{ static_cast<unsigned long long>(seed), static_cast<unsigned long long>(j) };
+	std::mt19937_64 rng(seq);
+	std::discrete_distribution<uword> pick(w.begin(), w.end());
+	std::normal_distribution<double> norm(0.0, 1.0);
+	// mixture component of each sample, and the samples bucketed by
+	// component in one counting pass: those of component p are
+	// order[first[p]], ..., order[first[p + 1] - 1]
+	uvec comp(n_samples);
+	uvec first(P + 1, arma::fill::zeros);
+	for (uword m = 0; m < n_samples; ++m) {
+		comp.at(m) = pick(rng);
+		++first.at(comp.at(m) + 1);
+	}
+	for (uword p = 0; p < P; ++p) first.at(p + 1) += first.at(p);
+	uvec order(n_samples), next = first.head(P);
+	for (uword m = 0; m < n_samples; ++m) order.at(next.at(comp.at(m))++) = m;
+
+	// Q X M samples; the lfsr decides which pairs count towards sharing
+	mat x(Q, n_samples);
+	vec neg(Q, arma::fill::zeros), zero(Q, arma::fill::zeros);
+	vec z(s_j.n_elem);
+	// A S, or S when there is no A
+	mat AS;
+	if (!a_mat.is_empty()) AS = a_mat.each_row() % s_j.t();
+	for (uword p = 0; p < P; ++p) {
+		vec mu1 = (K_cube.slice(p).t() * b_o) % s_j;
+		vec var;
+		if (a_mat.is_empty()) var = U0_cube.slice(p).diag() % s_j % s_j;
+		else {
+			mu1 = a_mat * mu1;
+			var = sum((AS * U0_cube.slice(p)) % AS, 1);
+		}
+		vec sigma   = sqrt(var);
+		vec neg_p   = pnorm(mu1, mean, sigma);
+		for (uword q = 0; q < Q; ++q) {
+			if (sigma.at(q) == 0) {
+				zero.at(q) += w.at(p);
+				neg_p.at(q) = 0.0;
+			}
+		}
+		neg += w.at(p) * neg_p;
+
+		if (first.at(p) == first.at(p + 1)) continue;
+		mat root = F_cube.slice(p).each_col() % s_j;
+		if (!a_mat.is_empty()) root = a_mat * root;
+		for (uword i = first.at(p); i < first.at(p + 1); ++i) {
+			for (uword r = 0; r < z.n_elem; ++r) z.at(r) = norm(rng);
+			x.col(order.at(i)) = mu1 + root * z;
+		}
+	}
+
+	// quantiles, type 7 as in R's quantile()
+	rowvec sorted;
+	for (uword q = 0; q < Q; ++q) {
+		sorted = arma::sort(x.row(q));
+		neg_freq.at(j, q) = (double) accu(sorted < 0) / n_samples;
+		pos_freq.at(j, q) = (double) accu(sorted > 0) / n_samples;
+		for (uword k = 0; k < probs.n_elem; ++k) {
+			double h  = (n_samples - 1) * probs.at(k);
+			uword  lo = (uword) std::floor(h);
+			uword  hi = std::min(lo + 1, n_samples - 1);
+			quantiles.at(j, q, k) = sorted.at(lo) + (h - lo) * (sorted.at(hi) - sorted.at(lo));
+		}
+	}
+
+	// pairwise sharing over the conditions where the effect is significant
+	uvec sig(Q);
+	for (uword q = 0; q < Q; ++q) {
+		double lfsr = (neg.at(q) > 0.5 * (1 - zero.at(q))) ? 1 - neg.at(q) : neg.at(q) + zero.at(q);
+		sig.at(q) = lfsr < lfsr_thresh;
+	}
+	if (!arma::any(sig)) return;
+	x.transform([fun_type](double v) { return sharing_transform(v, fun_type); });
+	accumulate_sharing(x, sig, factor, true, share_num, share_den);
+}
+
+// This implements the sample method in the PosteriorSampler class. Effects
+// are grouped as in mash_compute_posterior_grouped so the factorisations
+// are shared; each thread accumulates its own sharing counts, which are
+// added up at the end.
+int
+mash_sample_posterior(const mat&   b_mat,
+                      const SE &   s_obj,
+                      const mat &  v_mat,
+                      const mat &  l_mat,
+                      const mat &  m_mat,
+                      const mat &  a_mat,
+                      const cube & U_cube,
+                      const mat &  posterior_weights,
+                      const uword  n_samples,
+                      const uword  seed,
+                      const vec &  probs,
+                      const double factor,
+                      const double lfsr_thresh,
+                      const int    fun_type,
+                      cube &       quantiles,
+                      mat &        neg_freq,
+                      mat &        pos_freq,
+                      mat &        share_num,
+                      mat &        share_den)
+{
+	uword J = b_mat.n_cols;
+	uword Q = a_mat.is_empty() ? b_mat.n_rows : a_mat.n_rows;
+
+	quantiles.zeros(J, Q, probs.n_elem);
+	neg_freq.zeros(J, Q);
+	pos_freq.zeros(J, Q);
+	share_num.zeros(Q, Q);
+	share_den.zeros(Q, Q);
+	if (n_samples == 0) return 0;
+
+	Contrast contrast(l_mat);
+	std::vector<EffectGroup> groups = group_effects(s_obj.get_original(), m_mat, b_mat.n_rows);
+	std::vector<size_t> small;
+	// thread local Q X Q sharing accumulators
+	int n_thread = get_max_threads();
+	cube num_cube(Q, Q, n_thread, arma::fill::zeros);
+	cube den_cube(Q, Q, n_thread, arma::fill::zeros);
+	progress_expect(J);
+
+	for (size_t g = 0; g < groups.size(); ++g) {
+		if (groups[g].effects.n_elem < LARGE_GROUP) {
+			small.push_back(g);
+			continue;
+		}
+		if (progress_cancelled()) break;
+		uvec obs = groups[g].obs;
+		uvec idx = groups[g].effects;
+		cube K_cube, U0_cube, F_cube;
+		get_missing_factors(get_cov(s_obj.get_original().col(idx.at(0)), v_mat, contrast),
+		                    obs, U_cube, K_cube, U0_cube);
+		get_sqrt_factors(U0_cube, F_cube);
+	#pragma 		omp parallel for schedule(static) default(none) shared(posterior_weights, n_samples, seed, probs, factor, lfsr_thresh, fun_type, obs, idx, K_cube, U0_cube, F_cube, quantiles, neg_freq, pos_freq, num_cube, den_cube, b_mat, s_obj, a_mat)
+		for (uword k = 0; k < idx.n_elem; ++k) {
+			// one group can hold every effect, so each effect is a tile
+			if (progress_cancelled()) continue;
+			int t = get_thread_id();
+			mash_sample_effect(idx.at(k), b_mat, s_obj, a_mat, obs, K_cube, U0_cube,
+			                   F_cube, posterior_weights, n_samples, seed, probs, factor,
+			                   lfsr_thresh, fun_type, quantiles, neg_freq, pos_freq,
+			                   num_cube.slice(t), den_cube.slice(t));
+			progress_tick();
+		}
+	}
+    #pragma 	omp parallel for schedule(dynamic) default(none) shared(groups, small, contrast, posterior_weights, n_samples, seed, probs, factor, lfsr_thresh, fun_type, quantiles, neg_freq, pos_freq, num_cube, den_cube, b_mat, s_obj, v_mat, a_mat, U_cube)
+	for (size_t k = 0; k < small.size(); ++k) {
+		if (progress_cancelled()) continue;
+		const EffectGroup & group = groups[small[k]];
+		int t = get_thread_id();
+		cube K_cube, U0_cube, F_cube;
+		get_missing_factors(get_cov(s_obj.get_original().col(group.effects.at(0)), v_mat, contrast),
+		                    group.obs, U_cube, K_cube, U0_cube);
+		get_sqrt_factors(U0_cube, F_cube);
+		for (uword i = 0; i < group.effects.n_elem; ++i) {
+			mash_sample_effect(group.effects.at(i), b_mat, s_obj, a_mat, group.obs,
+			                   K_cube, U0_cube, F_cube, posterior_weights, n_samples, seed,
+			                   probs, factor, lfsr_thresh, fun_type, quantiles,
+			                   neg_freq, pos_freq, num_cube.slice(t), den_cube.slice(t));
+		}
+		progress_tick(group.effects.n_elem);
+	}
+	for (int t = 0; t < n_thread; ++t) {
+		share_num += num_cube.slice(t);
+		share_den += den_cube.slice(t);
+	}
+	// the kernel fills the upper triangle
+	share_num = arma::symmatu(share_num);
+	share_den = arma::symmatu(share_den);
+
+	return 0;
+} // mash_sample_posterior
+
+// BATCH DRIVER
+// ------------
+// One of many small, independent mash problems fitted by
+// fit_mash_batch. All matrices are R by J except v_mat, R by R.
+struct MashProblem
+{
+	// input
+	mat b_mat;
+	mat s_mat;
+	mat s_alpha_mat;
+	mat v_mat;
+	mat m_mat;     // missingness mask, may be empty
+	// output
+	vec pi;
+	mat post_mean;
+	mat post_sd;
+	mat neg_prob;
+	mat zero_prob;
+	mat lfsr;
+	double loglik;
+	int niter;
+	int status;    // 0 converged, 1 not converged, 2 failed
+	std::string message;
+};
+
+// @title EM for the mixture proportions
+// @description maximises sum_j c[j] log(sum_p lik[j,p] pi[p]) + sum_p (prior[p] - 1) log(pi[p]),
+// the penalised likelihood of ashr::mixEM, from the starting value in pi
+// @param lik J x P matrix of likelihoods, each row scaled to have maximum 1
+// @param counts J weights c of the rows; all 1 if empty. Rows with weight 0
+// play no part, so resampled fits can share one likelihood matrix.
+// @return the number of iterations, or -1 if it did not converge
+inline int
+mixture_em(const mat & lik, const vec & counts, const vec & prior, vec & pi,
+           int maxiter, double tol)
+{
+	// the posterior weights w[j,p] = lik[j,p] pi[p] / f[j] are only needed
+	// summed over j, so only J vectors are formed
+	uvec unused;
+	if (!counts.is_empty()) unused = find(counts == 0);
+	vec f, g;
+	for (int iter = 1; iter <= maxiter; ++iter) {
+		f = lik * pi;
+		if (counts.is_empty()) g = 1.0 / f;
+		else g = counts / f;
+		g.elem(unused).zeros();
+		vec pi_new = pi % (lik.t() * g) + prior - 1.0;
+		pi_new.elem(find(pi_new < 0)).zeros();
+		pi_new /= accu(pi_new);
+		double delta = max(abs(pi_new - pi));
+		pi = pi_new;
+		if (delta < tol) return iter;
+	}
+	return -1;
+}
+
+inline int
+mixture_em(const mat & lik, const vec & prior, vec & pi, int maxiter, double tol)
+{
+	return mixture_em(lik, vec(), prior, pi, maxiter, tol);
+}
+
+// @title Relative likelihoods of a problem
+// @param lik output, J x P likelihoods, each row scaled to have maximum 1
+// @param lfactors output, J log scale factors of the rows
+// @param common_cov output, whether all effects share their covariance
+// @return false, with pb marked as failed, if a likelihood is not finite
+inline bool
+mash_problem_lik(MashProblem & pb, const cube & U_cube, mat & lik,
+                 vec & lfactors, bool & common_cov)
+{
+	common_cov = pb.m_mat.is_empty()
+	             && arma::all(arma::vectorise(pb.s_mat.each_col() - pb.s_mat.col(0)) == 0)
+	             && arma::all(arma::vectorise(pb.s_alpha_mat.each_col() - pb.s_alpha_mat.col(0)) == 0);
+	mat llik = calc_lik_problem(pb.b_mat, pb.s_mat, pb.v_mat, pb.m_mat, U_cube, common_cov);
+	lfactors = arma::max(llik, 1);
+	lik      = exp(llik.each_col() - lfactors);
+	if (!lik.is_finite()) {
+		pb.status  = 2;
+		pb.message = "non-finite likelihoods";
+		return false;
+	}
+	return true;
+}
+
+// @title Posterior summaries of a problem, on the calling thread
+// @description the grouped kernel of mash_compute_posterior_grouped, with
+// report type 3. Like calc_lik_problem it leaves the number of threads and
+// the progress alone, so it can run in the workers of fit_mash_batch and
+// MashPipeline. Without a mask the groups are the effects sharing their
+// standard errors, one group when they all do.
+// @param m_mat R by J missingness mask, non-zero for missing measurements; may be empty
+inline void
+mash_compute_posterior_problem(const mat &  b_mat,
+                               const SE &   s_obj,
+                               const mat &  v_mat,
+                               const mat &  m_mat,
+                               const cube & U_cube,
+                               mat &        post_mean,
+                               mat &        post_var,
+                               mat &        neg_prob,
+                               mat &        zero_prob,
+                               const mat &  posterior_weights)
+{
+	mat no_transform;
+	cube post_cov;
+	cube K_cube, U0_cube;
+	std::vector<EffectGroup> groups = group_effects(s_obj.get_original(), m_mat, b_mat.n_rows);
+	for (size_t g = 0; g < groups.size(); ++g) {
+		const EffectGroup & group = groups[g];
+		get_missing_factors(get_cov(s_obj.get_original().col(group.effects.at(0)), v_mat),
+		                    group.obs, U_cube, K_cube, U0_cube);
+		for (uword i = 0; i < group.effects.n_elem; ++i)
+			mash_posterior_effect<PosteriorTransform<false>, PosteriorOutputs<3> >(
+				group.effects.at(i), b_mat, s_obj, no_transform, group.obs, K_cube, U0_cube,
+				post_mean, post_var, neg_prob, zero_prob, post_cov, posterior_weights);
+	}
+}
+
+// @title Posterior summaries and lfsr of a problem with proportions pb.pi
+// @param lik the likelihoods from mash_problem_lik
+inline void
+mash_problem_posterior(MashProblem & pb, const cube & U_cube, const mat & lik,
+                       double pi_thresh)
+{
+	uword J = pb.b_mat.n_cols;
+	// posterior weights over the components above pi_thresh
+	uvec comp = find(pb.pi > pi_thresh);
+	cube U_comp(U_cube.n_rows, U_cube.n_cols, comp.n_elem);
+	for (uword k = 0; k < comp.n_elem; ++k) U_comp.slice(k) = U_cube.slice(comp.at(k));
+	mat weights = lik.cols(comp).each_row() % trans(pb.pi.elem(comp));
+	weights.each_col() /= sum(weights, 1);
+	weights = weights.t();
+
+	SE s_obj;
+	s_obj.set(pb.s_mat, pb.s_alpha_mat);
+	s_obj.set_original(mat());
+	uword R = pb.b_mat.n_rows;
+	mat post_var(R, J, arma::fill::zeros);
+	pb.post_mean.zeros(R, J);
+	pb.neg_prob.zeros(R, J);
+	pb.zero_prob.zeros(R, J);
+	mash_compute_posterior_problem(pb.b_mat, s_obj, pb.v_mat, pb.m_mat, U_comp, pb.post_mean,
+	                               post_var, pb.neg_prob, pb.zero_prob, weights);
+	pb.post_sd = sqrt(post_var);
+	pb.lfsr.set_size(R, J);
+	for (uword i = 0; i < pb.lfsr.n_elem; ++i) {
+		double neg = pb.neg_prob.at(i), zero = pb.zero_prob.at(i);
+		pb.lfsr.at(i) = (neg > 0.5 * (1 - zero)) ? 1 - neg : neg + zero;
+	}
+}
+
+// @title Fit one problem: likelihood, mixture proportions, posterior, lfsr
+// @description runs single threaded; the batch is parallel over problems
+// @param U_cube R x R x P scaled prior covariances, shared by the problems
+// @param prior P penalty of the mixture proportions
+inline void
+fit_mash_problem(MashProblem & pb, const cube & U_cube, const vec & prior,
+                 int maxiter, double tol, double pi_thresh)
+{
+	uword P = U_cube.n_slices;
+	pb.niter  = 0;
+	pb.loglik = datum::nan;
+
+	mat lik;
+	vec lfactors;
+	bool common_cov;
+	if (!mash_problem_lik(pb, U_cube, lik, lfactors, common_cov)) return;
+
+	pb.pi.set_size(P);
+	pb.pi.fill(1.0 / P);
+	pb.niter  = mixture_em(lik, prior, pb.pi, maxiter, tol);
+	pb.status = (pb.niter < 0) ? 1 : 0;
+	pb.loglik = accu(log(lik * pb.pi) + lfactors) - accu(log(pb.s_alpha_mat));
+	mash_problem_posterior(pb, U_cube, lik, pi_thresh);
+}
+
+// @title Fit many independent mash problems concurrently
+// @description problems are handed out one at a time to the threads as
+// they become free, so a few large problems do not hold up the rest. A
+// problem that fails is marked in its status and does not stop the batch.
+// @return the number of problems that failed
+inline int
+fit_mash_batch(std::vector<MashProblem> & problems, const cube & U_cube,
+               const vec & prior, int maxiter, double tol, double pi_thresh)
+{
+	int n_failed = 0;
+	progress_expect(problems.size());
+
+	#pragma \
+	omp parallel for schedule(dynamic, 1) default(none) shared(problems, U_cube, prior, maxiter, tol, pi_thresh) reduction(+:n_failed)
+	for (size_t i = 0; i < problems.size(); ++i) {
+		if (progress_cancelled()) continue;
+		try {
+			fit_mash_problem(problems[i], U_cube, prior, maxiter, tol, pi_thresh);
+		} catch (const std::exception & e) {
+			problems[i].status  = 2;
+			problems[i].message = e.what();
+		}
+		if (problems[i].status == 2) ++n_failed;
+		progress_tick();
+	}
+	return n_failed;
+}
+
+// @title Bootstrap the mixture proportions
+// @description resampling effects only reweights the rows of the
+// likelihood matrix, so each replicate draws multinomial counts of the J
+// rows and refits pi by EM on the same matrix, warm started from the
+// full data fit; a replicate only adds vectors of length J. Replicates are handed out to the threads as they become
+// free; replicate b uses its own generator seeded with (seed, b), so the
+// result does not depend on the number of threads.
+// @param lik J x P likelihoods, each row scaled to have maximum 1
+// @param offset J log-likelihood to add back to each row
+// @param pi0 P the starting value of every fit
+// @param pi_out output, P x B fitted proportions
+// @param loglik_out output, B log-likelihoods of the resampled data
+// @param niter_out output, B numbers of iterations, -1 if not converged
+inline void
+bootstrap_mixture(const mat & lik, const vec & offset, const vec & prior,
+                  const vec & pi0, uword B, uword seed, int maxiter, double tol,
+                  mat & pi_out, vec & loglik_out, arma::ivec & niter_out)
+{
+	uword J = lik.n_rows;
+	pi_out.set_size(lik.n_cols, B);
+	loglik_out.set_size(B);
+	loglik_out.fill(datum::nan);
+	niter_out.set_size(B);
+	niter_out.fill(-1);
+	progress_expect(B);
+	#pragma \
+	omp parallel for schedule(dynamic, 1) default(none) shared(lik, offset, prior, pi0, B, seed, maxiter, tol, pi_out, loglik_out, niter_out, J)
+	for (uword b = 0; b < B; ++b) {
+		if (progress_cancelled()) continue;
+		std::seed_seq seq{ static_cast<unsigned long long>(seed), static_cast<unsigned long long>(b) };
+		std::mt19937_64 rng(seq);
+		std::uniform_int_distribution<uword> draw(0, J - 1);
+		vec counts(J, arma::fill::zeros);
+		for (uword i = 0; i < J; ++i) counts.at(draw(rng)) += 1;
+		vec pi = pi0;
+		niter_out.at(b) = mixture_em(lik, counts, prior, pi, maxiter, tol);
+		pi_out.col(b)   = pi;
+		// rows not drawn play no part in the log-likelihood
+		uvec rows = find(counts > 0);
+		vec f     = lik * pi;
+		loglik_out.at(b) = dot(counts.elem(rows), log(f.elem(rows)) + offset.elem(rows));
+		progress_tick();
+	}
+}
+
+// DATA PREPARATION
+// ----------------
+// The transforms of mash_set_data, applied block by block to J X R
+// inputs in R's column-major layout, so that the expensive quantile
+// functions are evaluated once per element and no full size temporaries
+// are made. The first pass (prepare_scan) only checks and counts; the
+// second (prepare_block) writes the prepared rows.
+
+// R's NA_real_ is a NaN whose lower word is 1954; other NaNs are errors
+const unsigned int R_NA_WORD = 1954;
+
+inline bool
+is_r_na(const double & x)
+{
+	if (!std::isnan(x)) return false;
+	unsigned long long bits;
+	std::memcpy(&bits, &x, sizeof(bits));
+	return (bits & 0xffffffffULL) == R_NA_WORD;
+}
+
+inline double
+r_na()
+{
+	unsigned long long bits = 0x7ff0000000000000ULL | R_NA_WORD;
+	double x;
+	std::memcpy(&x, &bits, sizeof(x));
+	return x;
+}
+
+// @title Input to the data preparation
+// @description s is J X R, or NULL for a constant s_value; pval replaces
+// s when not NULL; df is J X R, or NULL for a constant df_value
+struct PrepareInput
+{
+	const double * b;
+	const double * s;
+	const double * pval;
+	const double * df;
+	uword J, R;
+	double s_value, df_value, alpha, zero_tol, zero_both_reset, zero_s_reset;
+};
+
+// @title Counts from the checking pass
+struct PrepareSummary
+{
+	uword n_bad_pval; // zero p-values
+	uword n_bad_b;    // NaN or Inf in Bhat
+	uword n_bad_s;    // NaN or Inf in Shat
+	uword n_zero_both;
+	uword n_zero_s;
+	uword n_na;       // missing Bhat
+	uword n_mismatch; // missing in one of Bhat and Shat only
+	uword n_not_one;  // Shat != 1, as it will be after zero resets
+	int zero_reset;   // 0 none, 1 both-zero entries, 2 all zero Shat
+};
+
+// status codes of prepare_data
+const int PREPARE_OK            = 0;
+const int PREPARE_ZERO_PVAL     = 1;
+const int PREPARE_BAD_BHAT      = 2;
+const int PREPARE_BAD_SHAT      = 3;
+const int PREPARE_ZERO_BOTH     = 4;
+const int PREPARE_ZERO_SHAT     = 5;
+const int PREPARE_MISSING_SHAT  = 6;
+
+inline bool
+has_finite_df(const PrepareInput & in)
+{
+	if (in.df == NULL) return !std::isinf(in.df_value);
+	for (uword i = 0; i < in.J * in.R; ++i)
+		if (!std::isinf(in.df[i])) return true;
+	return false;
+}
+
+// Shat before the zero checks, from s or from pval as in p2z
+inline double
+prepare_initial_s(const PrepareInput & in, uword i)
+{
+	if (in.pval != NULL) {
+		double b = in.b[i], p = in.pval[i];
+		if (is_r_na(b) || is_r_na(p)) return r_na();
+		double z = std::fabs(gsl_cdf_ugaussian_Pinv(p / 2));
+		return b / ((b < 0) ? -z : z);
+	}
+	return (in.s == NULL) ? in.s_value : in.s[i];
+}
+
+// @title Checking pass
+// @description counts, over all elements, the problems mash_set_data
+// reports, and decides which zero standard errors will be reset
+inline void
+prepare_scan(const PrepareInput & in, PrepareSummary & sm)
+{
+	uword n = in.J * in.R;
+	uword n_bad_pval = 0, n_bad_b = 0, n_bad_s = 0, n_zero_both = 0, n_zero_s = 0,
+	      n_na = 0, n_na_s = 0, n_na_both = 0, n_one = 0, n_one_both = 0,
+	      n_one_all = 0;
+	bool finite_df = has_finite_df(in);
+
+	#pragma \
+	omp parallel for schedule(static) default(none) shared(in, n, finite_df) reduction(+:n_bad_pval, n_bad_b, n_bad_s, n_zero_both, n_zero_s, n_na, n_na_s, n_na_both, n_one, n_one_both, n_one_all)
+	for (uword i = 0; i < n; ++i) {
+		double b = in.b[i];
+		if (in.pval != NULL && in.pval[i] == 0) ++n_bad_pval;
+		double s = prepare_initial_s(in, i);
+		bool na_b = is_r_na(b), na_s = is_r_na(s);
+		if (!na_b && (std::isnan(b) || std::isinf(b))) ++n_bad_b;
+		if (!na_s && (std::isnan(s) || std::isinf(s))) ++n_bad_s;
+		bool zero_s = !na_s && s <= in.zero_tol;
+		bool zero_both = zero_s && !na_b && b <= in.zero_tol;
+		if (zero_s) ++n_zero_s;
+		if (zero_both) ++n_zero_both;
+		if (na_b) ++n_na;
+		// with finite df, Shat is recomputed from Bhat and 0 / 0 is missing
+		bool na_s_final = na_s || (finite_df && !na_b && b == 0);
+		if (na_s_final) ++n_na_s;
+		if (na_b && na_s_final) ++n_na_both;
+		// Shat == 1 under each of the possible zero resets
+		if (!na_s_final && !finite_df) {
+			if (s == 1) ++n_one;
+			if ((zero_both ? in.zero_both_reset : s) == 1) ++n_one_both;
+			if ((zero_s ? in.zero_s_reset : s) == 1) ++n_one_all;
+		}
+	}
+	sm.n_bad_pval  = n_bad_pval;
+	sm.n_bad_b     = n_bad_b;
+	sm.n_bad_s     = n_bad_s;
+	sm.n_zero_both = n_zero_both;
+	sm.n_zero_s    = n_zero_s;
+	sm.n_na        = n_na;
+	sm.n_mismatch  = (n_na - n_na_both) + (n_na_s - n_na_both);
+	sm.zero_reset  = 0;
+	if (n_zero_both > 0 && in.zero_both_reset > 0) sm.zero_reset = 1;
+	else if (n_zero_both == 0 && n_zero_s > 0 && in.zero_s_reset > 0) sm.zero_reset = 2;
+	uword ones = (sm.zero_reset == 1) ? n_one_both : (sm.zero_reset == 2) ? n_one_all : n_one;
+	sm.n_not_one = n - ones;
+}
+
+// @return the status of the prepared data, in the order mash_set_data
+// checks them
+inline int
+prepare_status(const PrepareSummary & sm)
+{
+	if (sm.n_bad_pval > 0) return PREPARE_ZERO_PVAL;
+	if (sm.n_bad_b > 0) return PREPARE_BAD_BHAT;
+	if (sm.n_bad_s > 0) return PREPARE_BAD_SHAT;
+	if (sm.n_zero_both > 0 && sm.zero_reset != 1) return PREPARE_ZERO_BOTH;
+	if (sm.n_zero_s > 0 && sm.n_zero_both == 0 && sm.zero_reset != 2) return PREPARE_ZERO_SHAT;
+	if (sm.n_mismatch > 0 && sm.n_not_one > 0) return PREPARE_MISSING_SHAT;
+	return PREPARE_OK;
+}
+
+// @title Writing pass for rows j0, ..., j1 - 1
+// @description writes Bhat, Shat and Shat_alpha, as mash_set_data returns
+// them, and the missing mask (unless m_out is NULL) to column-major
+// outputs with leading dimension ld, row j going to row j - j0
+inline void
+prepare_block(const PrepareInput & in, const PrepareSummary & sm, bool finite_df,
+              uword j0, uword j1, uword ld, double * b_out, double * s_out,
+              double * sa_out, int * m_out)
+{
+	bool scale = in.alpha != 0 && sm.n_not_one > 0;
+	for (uword r = 0; r < in.R; ++r) {
+		for (uword j = j0; j < j1; ++j) {
+			uword i = j + r * in.J, o = (j - j0) + r * ld;
+			double b = in.b[i], s = prepare_initial_s(in, i);
+			bool na_b = is_r_na(b);
+			if (!std::isnan(s) && s <= in.zero_tol) {
+				if (sm.zero_reset == 2 || (sm.zero_reset == 1 && !na_b && b <= in.zero_tol))
+					s = (sm.zero_reset == 1) ? in.zero_both_reset : in.zero_s_reset;
+			}
+			double df = (in.df == NULL) ? in.df_value : in.df[i];
+			if (finite_df && !na_b && !std::isnan(s) && !std::isinf(df)) {
+				// Shat = Bhat / p2z(2 * pt(-abs(Bhat / Shat), df), Bhat)
+				double p = 2 * gsl_cdf_tdist_P(-std::fabs(b / s), df);
+				double z = std::fabs(gsl_cdf_ugaussian_Pinv(p / 2));
+				s = b / ((b < 0) ? -z : z);
+			}
+			double sa = 1;
+			if (scale) {
+				sa = std::pow(s, in.alpha);
+				b /= sa;
+				s  = std::pow(s, 1 - in.alpha);
+			}
+			bool missing = na_b;
+			if (missing) {
+				b  = 0;
+				s  = 1E6;
+				sa = 1;
+			}
+			b_out[o]  = b;
+			s_out[o]  = s;
+			sa_out[o] = sa;
+			if (m_out != NULL) m_out[o] = missing;
+		}
+	}
+}
+
+// @title Prepare all of the data into J X R outputs
+// @param sm the summary of prepare_scan, with status PREPARE_OK
+inline int
+prepare_data(const PrepareInput & in, const PrepareSummary & sm, double * b_out,
+             double * s_out, double * sa_out, int * m_out)
+{
+	bool finite_df = has_finite_df(in);
+	uword block   = std::max((uword) 1, get_block_size(in.R));
+	uword nblocks = (in.J + block - 1) / block;
+
+	#pragma \
+	omp parallel for schedule(static) default(none) shared(in, sm, finite_df, block, nblocks, b_out, s_out, sa_out, m_out)
+	for (uword k = 0; k < nblocks; ++k) {
+		uword j0 = k * block, j1 = std::min(in.J, j0 + block);
+		prepare_block(in, sm, finite_df, j0, j1, in.J, b_out + j0, s_out + j0,
+		              sa_out + j0, (m_out == NULL) ? NULL : m_out + j0);
+	}
+	return 0;
+}
+
+// UDI COVARIANCES
+// ---------------
+// Covariances of the "Unassociated", "Directly associated" and
+// "Indirectly associated" models, as in cov_udi_single in R. A model
+// needs the inverses of V restricted to its U conditions and to its U and
+// D conditions; there are 2^R such blocks against 3^R models, so they
+// are computed once, in parallel, and shared by all models.
+const int UDI_U = 0;
+const int UDI_D = 1;
+const int UDI_I = 2;
+// keeps the 2^R inverses within a few tens of MB
+const uword UDI_MAX_R = 16;
+
+inline uvec
+mask_index(uword mask)
+{
+	std::vector<uword> idx;
+	for (uword r = 0; mask != 0; ++r, mask >>= 1)
+		if (mask & 1) idx.push_back(r);
+	return arma::conv_to<uvec>::from(idx);
+}
+
+// @return the number of U/D/I assignments of R conditions, 3^R
+inline uword
+udi_n_models(uword R)
+{
+	uword n = 1;
+	for (uword r = 0; r < R; ++r) n *= 3;
+	return n;
+}
+
+// @title Assignment k of the 3^R, in the order of udi_model_matrix in R
+inline arma::ivec
+udi_model(uword k, uword R)
+{
+	arma::ivec model(R);
+	for (uword r = 0; r < R; ++r, k /= 3) model.at(r) = k % 3;
+	return model;
+}
+
+class UDIGenerator
+{
+public:
+explicit UDIGenerator(const mat & V_mat) : V(V_mat)
+{
+	uword R = V_mat.n_rows;
+	if (R > UDI_MAX_R)
+		throw std::invalid_argument("UDI models are limited to 16 conditions");
+	uword n = (uword) 1 << R;
+	inv.resize(n);
+	std::vector<mat> & blocks = inv;
+	int n_failed = 0;
+	#pragma \
+	omp parallel for schedule(dynamic) default(none) shared(n, V_mat, blocks) reduction(+:n_failed)
+	for (uword mask = 1; mask < n; ++mask) {
+		uvec idx = mask_index(mask);
+		if (!arma::inv_sympd(blocks[mask], V_mat.submat(idx, idx))) ++n_failed;
+	}
+	if (n_failed > 0)
+		throw std::runtime_error("V is not positive definite");
+}
+
+~UDIGenerator(){
+}
+
+// @param model R codes UDI_U, UDI_D or UDI_I, with at least one UDI_D
+mat
+cov(const arma::ivec & model) const
+{
+	uword R = V.n_rows, umask = 0, dmask = 0, imask = 0;
+	for (uword r = 0; r < R; ++r) {
+		if (model.at(r) == UDI_U) umask |= (uword) 1 << r;
+		else if (model.at(r) == UDI_D) dmask |= (uword) 1 << r;
+		else imask |= (uword) 1 << r;
+	}
+	uvec D = mask_index(dmask), I = mask_index(imask);
+	// Schur complement of the U block
+	mat U0 = V.submat(D, D);
+	if (umask != 0) {
+		mat VDU = V.submat(D, mask_index(umask));
+		U0 -= VDU * inv[umask] * VDU.t();
+	}
+	mat res(R, R, arma::fill::zeros);
+	res.submat(D, D) = U0;
+	if (imask != 0) {
+		// Ic = (U, D) in increasing order; pos are the D columns among them
+		uword cmask = umask | dmask;
+		uvec Ic     = mask_index(cmask);
+		std::vector<uword> pos;
+		for (uword k = 0; k < Ic.n_elem; ++k)
+			if ((dmask >> Ic.at(k)) & 1) pos.push_back(k);
+		mat W  = V.submat(I, Ic) * inv[cmask].cols(arma::conv_to<uvec>::from(pos));
+		mat ID = W * U0;
+		res.submat(I, D) = ID;
+		res.submat(D, I) = ID.t();
+		res.submat(I, I) = ID * W.t();
+	}
+	return res;
+}
+
+private:
+mat V;
+std::vector<mat> inv;
+};
+
+// @title Score of a prior covariance against the data
+// @description the log-likelihood of the effects under a mixture, with
+// equal weights, of U scaled by each grid value squared
+// @param sigma_cube R X R X G error covariances of the effect groups
+inline double
+score_covariance(const mat & U, const mat & b_mat,
+                 const std::vector<EffectGroup> & groups,
+                 const cube & sigma_cube, const vec & grid)
+{
+	uword G = grid.n_elem;
+	vec mean(b_mat.n_rows, arma::fill::zeros);
+	mat llik(b_mat.n_cols, G);
+	mat rooti;
+	for (size_t g = 0; g < groups.size(); ++g) {
+		const uvec & idx = groups[g].effects;
+		mat b_g = b_mat.cols(idx);
+		for (uword k = 0; k < G; ++k) {
+			if (!chol_rooti(rooti, sigma_cube.slice(g) + grid.at(k) * grid.at(k) * U)) {
+				for (uword i = 0; i < idx.n_elem; ++i) llik.at(idx.at(i), k) = -datum::inf;
+				continue;
+			}
+			vec l = dmvnorm_mat(b_g, mean, rooti, true, true);
+			for (uword i = 0; i < idx.n_elem; ++i) llik.at(idx.at(i), k) = l.at(i);
+		}
+	}
+	double score = 0;
+	for (uword j = 0; j < llik.n_rows; ++j) {
+		double m = llik.row(j).max();
+		score += m + std::log(accu(exp(llik.row(j) - m)) / G);
+	}
+	return score;
+}
+
+// @title Score a list of UDI models
+// @param models the models to score, in rows; if empty, all of the 3^R
+// assignments are generated as they are scored
+// @param ids the models to score, as row indices (or assignment indices)
+inline vec
+score_udi_models(const UDIGenerator & gen, const arma::imat & models,
+                 const std::vector<uword> & ids, const mat & b_mat,
+                 const mat & s_mat, const mat & v_mat, const vec & grid)
+{
+	std::vector<EffectGroup> groups = group_effects(s_mat, mat(), b_mat.n_rows);
+	cube sigma_cube(b_mat.n_rows, b_mat.n_rows, groups.size());
+	for (size_t g = 0; g < groups.size(); ++g)
+		sigma_cube.slice(g) = get_cov(s_mat.col(groups[g].effects.at(0)), v_mat);
+	vec scores(ids.size());
+	uword R = b_mat.n_rows;
+	progress_expect(ids.size());
+	#pragma \
+	omp parallel for schedule(dynamic) default(none) shared(gen, models, ids, b_mat, groups, sigma_cube, grid, scores, R)
+	for (size_t i = 0; i < ids.size(); ++i) {
+		if (progress_cancelled()) continue;
+		arma::ivec model = models.is_empty() ? udi_model(ids[i], R) : arma::ivec(trans(models.row(ids[i])));
+		scores.at(i) = score_covariance(gen.cov(model), b_mat, groups, sigma_cube, grid);
+		progress_tick();
+	}
+	return scores;
+}
+
+// @title Select the UDI models that best fit the data
+// @description scores every model on the effects in `screen`, keeps the
+// best n_rescore, and rescores those on all effects to return the best
+// n_top. Covariances are generated only when scored and only the kept
+// ones are stored, so all 3^R models can be searched for R up to 10 or so.
+// @param ids output, the selected models as in score_udi_models
+// @param scores output, their scores on all effects
+inline void
+udi_select(const UDIGenerator & gen, const arma::imat & models,
+           const mat & b_mat, const mat & s_mat, const mat & v_mat,
+           const vec & grid, const uvec & screen, uword n_top,
+           uword n_rescore, std::vector<uword> & ids, vec & scores)
+{
+	uword R = b_mat.n_rows;
+	uword n = models.is_empty() ? udi_n_models(R) : models.n_rows;
+	std::vector<uword> all;
+	for (uword k = 0; k < n; ++k) {
+		arma::ivec model = models.is_empty() ? udi_model(k, R) : arma::ivec(trans(models.row(k)));
+		if (arma::any(model == UDI_D)) all.push_back(k);
+	}
+	std::vector<uword> kept = all;
+	if (all.size() > n_rescore && screen.n_elem < b_mat.n_cols) {
+		vec s1 = score_udi_models(gen, models, all, b_mat.cols(screen),
+		                          s_mat.cols(screen), v_mat, grid);
+		uvec order = arma::sort_index(s1, "descend");
+		kept.resize(n_rescore);
+		for (uword i = 0; i < n_rescore; ++i) kept[i] = all[order.at(i)];
+	}
+	vec s2     = score_udi_models(gen, models, kept, b_mat, s_mat, v_mat, grid);
+	uvec order = arma::sort_index(s2, "descend");
+	n_top = std::min(n_top, (uword) kept.size());
+	ids.resize(n_top);
+	scores.set_size(n_top);
+	for (uword i = 0; i < n_top; ++i) {
+		ids[i]       = kept[order.at(i)];
+		scores.at(i) = s2.at(order.at(i));
+	}
+}
+
+// RANDOMISED SVD
+// --------------
+// Truncated SVD of some rows of a J X R matrix by a randomised range
+// finder with power iterations (Halko, Martinsson & Tropp 2011). The rows
+// are read in place, a block at a time per thread, and only n X l and
+// R X l panels are formed (l = k + oversampling), so the cost is O(nRl)
+// against O(nR^2) for a full decomposition. When l reaches R the range
+// is the whole row space and the result is exact up to rounding.
+const uword RSVD_BLOCK = 4096;
+
+// @title Y = X[rows, ] * Z
+inline void
+rsvd_multiply(const mat & X, const uvec & rows, const mat & Z, mat & Y)
+{
+	uword n = rows.n_elem, l = Z.n_cols;
+	uword nblocks = (n + RSVD_BLOCK - 1) / RSVD_BLOCK;
+	Y.zeros(n, l);
+	#pragma \
+	omp parallel for schedule(static) default(none) shared(X, rows, Z, Y, n, l, nblocks)
+	for (uword k = 0; k < nblocks; ++k) {
+		uword i0 = k * RSVD_BLOCK, i1 = std::min(n, i0 + RSVD_BLOCK);
+		for (uword c = 0; c < l; ++c) {
+			double * y = Y.colptr(c);
+			for (uword r = 0; r < X.n_cols; ++r) {
+				double z        = Z.at(r, c);
+				const double * x = X.colptr(r);
+				for (uword i = i0; i < i1; ++i) y[i] += x[rows.at(i)] * z;
+			}
+		}
+	}
+}
+
+// @title t(X[rows, ]) * Y, summed over row blocks with one accumulator
+// per thread
+inline mat
+rsvd_crossprod(const mat & X, const uvec & rows, const mat & Y)
+{
+	uword n = rows.n_elem, l = Y.n_cols;
+	uword nblocks = (n + RSVD_BLOCK - 1) / RSVD_BLOCK;
+	mat out(X.n_cols, l);
+	out.zeros();
+	#pragma \
+	omp parallel default(none) shared(X, rows, Y, out, n, l, nblocks)
+	{
+		mat acc(X.n_cols, l);
+		acc.zeros();
+	#pragma omp for schedule(static)
+		for (uword k = 0; k < nblocks; ++k) {
+			uword i0 = k * RSVD_BLOCK, i1 = std::min(n, i0 + RSVD_BLOCK);
+			for (uword c = 0; c < l; ++c) {
+				const double * y = Y.colptr(c);
+				for (uword r = 0; r < X.n_cols; ++r) {
+					const double * x = X.colptr(r);
+					double s         = 0;
+					for (uword i = i0; i < i1; ++i) s += x[rows.at(i)] * y[i];
+					acc.at(r, c) += s;
+				}
 			}
 		}
-		// compute weighted means of posterior arrays
 	#pragma omp critical
+		out += acc;
+	}
+	return out;
+}
+
+// @title Truncated SVD of X[rows, ]
+// @param k the number of singular values wanted
+// @param n_over the oversampling of the range
+// @param n_power the number of power iterations
+// @param d output, the k largest singular values
+// @param v_mat output, R X k, the corresponding right singular vectors
+inline int
+randomized_svd(const mat & X, const uvec & rows, uword k, uword n_over,
+               uword n_power, uword seed, vec & d, mat & v_mat)
+{
+	uword R = X.n_cols;
+	uword l = std::min(k + n_over, R);
+	std::mt19937_64 rng(seed);
+	std::normal_distribution<double> norm(0.0, 1.0);
+	mat Z(R, l), Y, Q, Rq;
+	for (uword i = 0; i < Z.n_elem; ++i) Z.at(i) = norm(rng);
+	rsvd_multiply(X, rows, Z, Y);
+	arma::qr_econ(Q, Rq, Y);
+	for (uword it = 0; it < n_power; ++it) {
+		// re-orthonormalise both panels to keep the small singular values
+		arma::qr_econ(Z, Rq, rsvd_crossprod(X, rows, Q));
+		rsvd_multiply(X, rows, Z, Y);
+		arma::qr_econ(Q, Rq, Y);
+	}
+	// t(Q) X[rows, ] is small, l X R, and has the wanted SVD
+	mat B = trans(rsvd_crossprod(X, rows, Q));
+	mat U_b, V_b;
+	vec s;
+	if (!arma::svd_econ(U_b, s, V_b, B)) return 1;
+	k     = std::min(k, (uword) s.n_elem);
+	d     = s.head(k);
+	v_mat = V_b.head_cols(k);
+	return 0;
+}
+
+// SINGLE EFFECT REGRESSION
+// ------------------------
+// The multivariate single effect regression (SER) of mvSuSiE regresses
+// the N X R residuals Y on each of the J columns of X in turn. Its
+// sufficient statistics bhat_j = x_j'Y / x_j'x_j and their standard
+// errors are computed here by blocks of columns of X, one GEMM per
+// block, and passed to MVSERMix directly.
+const uword SER_BLOCK = 256;
+
+// @title Sums of squares of the columns of X
+inline double
+column_ss(const mat & X, uword j)
+{
+	return dot(X.col(j), X.col(j));
+}
+
+inline double
+column_ss(const arma::sp_mat & X, uword j)
+{
+	double ss = 0;
+	for (arma::sp_mat::const_col_iterator it = X.begin_col(j); it != X.end_col(j); ++it)
+		ss += (*it) * (*it);
+	return ss;
+}
+
+// @title Sufficient statistics of the single effect regressions
+// @param X N X J genotypes, dense or sparse, used as (X - center) / scale
+// @param center J column means to subtract, or empty
+// @param scale J column scales to divide by, or empty
+// @param xtx J sums of squares of the standardised columns; computed if empty
+// @param resid_var R X R covariance of the residuals
+// @param b_mat output R X J estimates
+// @param s_mat output R X J standard errors
+template <typename MatX>
+inline void
+ser_sufficient_stats(const MatX & X, const mat & Y, const vec & center,
+                     const vec & scale, vec & xtx, const mat & resid_var,
+                     mat & b_mat, mat & s_mat)
+{
+	uword J = X.n_cols, R = Y.n_cols;
+	uword nblocks = (J + SER_BLOCK - 1) / SER_BLOCK;
+	bool given_xtx = !xtx.is_empty();
+	rowvec y_sum   = sum(Y, 0);
+	vec resid_sd2  = resid_var.diag();
+	if (!given_xtx) xtx.set_size(J);
+	b_mat.set_size(R, J);
+	s_mat.set_size(R, J);
+	progress_expect(J);
+	#pragma \
+	omp parallel for schedule(static) default(none) shared(X, Y, center, scale, xtx, b_mat, s_mat, J, nblocks, given_xtx, y_sum, resid_sd2)
+	for (uword k = 0; k < nblocks; ++k) {
+		if (progress_cancelled()) continue;
+		uword j0 = k * SER_BLOCK, j1 = std::min(J, j0 + SER_BLOCK) - 1;
+		// block X R
+		mat xty = trans(X.cols(j0, j1)) * Y;
+		for (uword j = j0; j <= j1; ++j) {
+			double mu = center.is_empty() ? 0 : center.at(j);
+			double sd = scale.is_empty() ? 1 : scale.at(j);
+			rowvec t  = xty.row(j - j0);
+			if (mu != 0) t -= mu * y_sum;
+			t /= sd;
+			if (!given_xtx) xtx.at(j) = (column_ss(X, j) - X.n_rows * mu * mu) / (sd * sd);
+			double d = xtx.at(j);
+			b_mat.col(j) = trans(t) / d;
+			s_mat.col(j) = sqrt(resid_sd2 / d);
+		}
+		progress_tick(j1 - j0 + 1);
+	}
+}
+
+// @title Fit one single effect regression with a mixture prior
+// @description computes the likelihoods of the estimates under each
+// scaled prior covariance and under the null, the posterior weights of
+// the mixture components and of the variables, and then the posterior
+// of the effects with MVSERMix.
+// @param U_cube R X R X P prior covariances
+// @param Uinv_cube their inverses to also compute the EM update of the
+// prior scale, or empty
+// @param pi P mixture proportions
+// @param prior_weights J prior probabilities of the variables
+// @param lbf output J log Bayes factors of the variables
+// @param alpha output J posterior probabilities of the variables
+// @param mix_weights output P X J posterior weights of the components
+// @return the log Bayes factor of the single effect model
+inline double
+mvser_fit(MVSERMix & ser, const mat & b_mat, const mat & s_mat,
+          const mat & v_mat, const cube & U_cube, const cube & Uinv_cube,
+          const vec & pi, const vec & prior_weights, vec & lbf, vec & alpha,
+          mat & mix_weights, int n_thread)
+{
+	bool common_cov = arma::all(arma::vectorise(s_mat.each_col() - s_mat.col(0)) == 0);
+	cube null_cube(v_mat.n_rows, v_mat.n_rows, 1, arma::fill::zeros);
+	// J X P and J X 1
+	mat llik  = calc_lik(b_mat, s_mat, v_mat, mat(), mat(), U_cube, cube(), true, common_cov, n_thread);
+	vec llik0 = calc_lik(b_mat, s_mat, v_mat, mat(), mat(), null_cube, cube(), true, common_cov, n_thread);
+	mat lbf_mat = llik.each_col() - llik0;
+	lbf_mat.each_row() += trans(log(pi));
+	vec lmax = arma::max(lbf_mat, 1);
+	mix_weights = exp(lbf_mat.each_col() - lmax);
+	vec total   = sum(mix_weights, 1);
+	lbf         = lmax + log(total);
+	mix_weights.each_col() /= total;
+	mix_weights = mix_weights.t();
+
+	vec lw         = lbf + log(prior_weights);
+	double lw_max  = lw.max();
+	alpha          = exp(lw - lw_max);
+	double lbf_all = lw_max + log(accu(alpha));
+	alpha /= accu(alpha);
+
+	mat variable_weights;
+	if (!Uinv_cube.is_empty()) {
+		ser.set_Uinv(Uinv_cube);
+		variable_weights = mix_weights.each_row() % alpha.t();
+	}
+	ser.set_thread(n_thread);
+	if (common_cov) ser.compute_posterior_comcov(mix_weights, variable_weights);
+	else ser.compute_posterior(mix_weights, variable_weights);
+	return lbf_all;
+}
+
+// K-MEANS INITIALISATION
+// ----------------------
+// Starting values for ED and TEEM from a k-means clustering of the
+// effects. The components of these mixtures have mean zero, so an effect
+// and its negation belong to the same component: the distance of x to a
+// centre c is that to the nearer of c and -c, and x joins the mean of its
+// cluster with the matching sign. The centres are seeded by k-means++
+// (Arthur & Vassilvitskii 2007). The amplitude of a component is the
+// share of the effects in its cluster and its covariance the second
+// moment of the cluster less the covariance of the errors.
+const int KMEANS_MAXITER = 50;
+
+// @title Squared distance of x to the nearer of c and -c
+// @param xc output, the inner product of x and c, whose sign says which
+inline double
+kmeans_dist(const double * x, const double * c, uword R, double xx,
+            double cc, double & xc)
+{
+	xc = 0;
+	for (uword r = 0; r < R; ++r) xc += x[r] * c[r];
+	return std::max(xx + cc - 2 * std::abs(xc), 0.0);
+}
+
+// @title Mixture starting values from a k-means clustering
+// @param X n X R effects, one per row
+// @param K the number of components
+// @param noise R X R covariance of the errors of the effects
+// @param eigen_floor the smallest eigenvalue of a covariance
+// @param w output, the K amplitudes
+// @param U output, R X R X K covariances
+// @param cluster output, the cluster of each effect
+inline int
+kmeans_init(const mat & X, uword K, uword seed, const mat & noise,
+            double eigen_floor, vec & w, cube & U, uvec & cluster)
+{
+	uword n = X.n_rows, R = X.n_cols;
+	if (K == 0 || n < K) return 1;
+	// one effect per column, to read them contiguously
+	mat Xt = trans(X);
+	rowvec xx = sum(arma::square(Xt), 0);
+	mat C(R, K);
+	vec dist(n);
+	dist.fill(datum::inf);
+	std::mt19937_64 rng(seed);
+	std::uniform_real_distribution<double> unif(0.0, 1.0);
+
+	// k-means++: each new centre is an effect drawn with probability
+	// proportional to its squared distance to the nearest centre so far
+	for (uword k = 0; k < K; ++k) {
+		uword pick   = std::min((uword) (unif(rng) * n), n - 1);
+		double total = (k == 0) ? 0 : accu(dist);
+		if (total > 0) {
+			double u = unif(rng) * total, s = 0;
+			for (pick = 0; pick < n - 1; ++pick) {
+				s += dist.at(pick);
+				if (s >= u) break;
+			}
+		}
+		C.col(k) = Xt.col(pick);
+		const double * c = C.colptr(k);
+		double cc        = dot(C.col(k), C.col(k));
+		#pragma \
+		omp parallel for schedule(static) default(none) shared(Xt, xx, dist, c, cc, n, R)
+		for (uword i = 0; i < n; ++i) {
+			double xc;
+			double d = kmeans_dist(Xt.colptr(i), c, R, xx.at(i), cc, xc);
+			if (d < dist.at(i)) dist.at(i) = d;
+		}
+	}
+
+	// Lloyd iterations, with one accumulator per thread
+	cluster.zeros(n);
+	uvec counts(K);
+	progress_expect(KMEANS_MAXITER);
+	for (int iter = 0; iter < KMEANS_MAXITER && !progress_cancelled(); ++iter) {
+		rowvec cc = sum(arma::square(C), 0);
+		mat sums(R, K, arma::fill::zeros);
+		counts.zeros();
+		uword changed = 0;
+		#pragma \
+		omp parallel default(none) shared(Xt, xx, C, cc, cluster, sums, counts, changed, n, R, K)
 		{
-			post_mean += mu1_mat.each_row() % posterior_weights.row(p);
-			post_var  += diag_mu2_mat.each_row() % posterior_weights.row(p);
-			neg_prob  += neg_mat.each_row() % posterior_weights.row(p);
-			zero_prob += zero_mat.each_row() % posterior_weights.row(p);
-			if (report_type == 2 || report_type == 4) {
-				for (uword j = 0; j < post_mean.n_cols; ++j) {
-					post_cov.slice(j) +=
-						posterior_weights.at(p, j) * (U1 + mu1_mat.col(j) * mu1_mat.col(j).t());
+			mat acc(R, K, arma::fill::zeros);
+			uvec cnt(K, arma::fill::zeros);
+			uword ch = 0;
+		#pragma omp for schedule(static)
+			for (uword i = 0; i < n; ++i) {
+				const double * x = Xt.colptr(i);
+				double best = datum::inf, sign = 1, xc;
+				uword kbest = 0;
+				for (uword k = 0; k < K; ++k) {
+					double d = kmeans_dist(x, C.colptr(k), R, xx.at(i), cc.at(k), xc);
+					if (d < best) {
+						best  = d;
+						kbest = k;
+						sign  = (xc < 0) ? -1 : 1;
+					}
 				}
+				if (cluster.at(i) != kbest) ++ch;
+				cluster.at(i) = kbest;
+				double * a = acc.colptr(kbest);
+				for (uword r = 0; r < R; ++r) a[r] += sign * x[r];
+				++cnt.at(kbest);
+			}
+		#pragma omp critical
+			{
+				sums    += acc;
+				counts  += cnt;
+				changed += ch;
 			}
 		}
+		// an empty cluster keeps its centre
+		for (uword k = 0; k < K; ++k)
+			if (counts.at(k) > 0) C.col(k) = sums.col(k) / counts.at(k);
+		progress_tick();
+		if (iter > 0 && changed == 0) break;
 	}
-	post_var -= pow(post_mean, 2.0);
-	//
-	if (report_type == 4) {
-	#pragma omp parallel for schedule(static) default(none) shared(post_cov, post_mean)
-		for (uword j = 0; j < post_mean.n_cols; ++j) {
-			post_cov.slice(j) -= post_mean.col(j) * post_mean.col(j).t();
+
+	// second moments of the clusters
+	cube M(R, R, K, arma::fill::zeros);
+	#pragma \
+	omp parallel default(none) shared(Xt, cluster, M, n, R, K)
+	{
+		cube acc(R, R, K, arma::fill::zeros);
+	#pragma omp for schedule(static)
+		for (uword i = 0; i < n; ++i) {
+			const double * x = Xt.colptr(i);
+			mat & S          = acc.slice(cluster.at(i));
+			for (uword b = 0; b < R; ++b)
+				for (uword a = 0; a < R; ++a) S.at(a, b) += x[a] * x[b];
 		}
+	#pragma omp critical
+		M += acc;
+	}
+	mat pooled = M.slice(0);
+	for (uword k = 1; k < K; ++k) pooled += M.slice(k);
+	pooled /= n;
+	w.set_size(K);
+	U.set_size(R, R, K);
+	for (uword k = 0; k < K; ++k) {
+		// an empty cluster starts from all the effects
+		mat S = (counts.at(k) > 0) ? mat(M.slice(k) / counts.at(k)) : pooled;
+		S -= noise;
+		vec eigval;
+		mat eigvec;
+		if (!eig_sym(eigval, eigvec, arma::symmatu(S))) return 1;
+		eigval     = arma::clamp(eigval, eigen_floor, datum::inf);
+		U.slice(k) = eigvec * diagmat(eigval) * trans(eigvec);
+		w.at(k)    = std::max(counts.at(k), (uword) 1);
 	}
+	w /= accu(w);
 	return 0;
-} // mash_compute_posterior_comcov
+}
 
 // This implements the core part of the compute_posterior method in
 // the MVSERMix class.
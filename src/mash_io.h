@@ -0,0 +1,900 @@
+// Binary files of prepared mash data
+#ifndef _MASH_IO_H
+#define _MASH_IO_H
+#include <cstdio>
+#ifndef _WIN32
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+#include <stdexcept>
+#include <stdint.h>
+#include "mash.h"
+
+// FILE FORMAT
+// -----------
+// A 48 byte header: the magic "MASHDAT1", then uint64 J and R, double
+// alpha, uint64 flags (bit 0: missing masks are present) and a reserved
+// uint64. It is followed by one record per effect,
+//   R doubles Bhat, R doubles Shat, R doubles Shat_alpha[, R bytes missing]
+// holding the data as mash_set_data prepares them, in the byte order of
+// the host. Records have a fixed size, so any range of effects can be
+// read without touching the rest of the file.
+const char MASH_FILE_MAGIC[8]  = { 'M', 'A', 'S', 'H', 'D', 'A', 'T', '1' };
+const uint64_t MASH_FILE_MISSING = 1;
+// elements prepared per chunk when writing
+const uword MASH_FILE_CHUNK = 1 << 20;
+
+struct MashFileHeader
+{
+	char magic[8];
+	uint64_t J;
+	uint64_t R;
+	double alpha;
+	uint64_t flags;
+	uint64_t reserved;
+};
+
+inline size_t
+mash_record_size(uint64_t R, bool has_missing)
+{
+	return 3 * R * sizeof(double) + (has_missing ? R : 0);
+}
+
+inline int
+mash_fseek(FILE * f, uint64_t offset)
+{
+	#ifdef _WIN32
+	return _fseeki64(f, (__int64) offset, SEEK_SET);
+	#else
+	return fseeko(f, (off_t) offset, SEEK_SET);
+	#endif
+}
+
+// @title Prepare data and write them to a file
+// @description runs the checks of prepare_scan over the whole input, then
+// prepares and writes it chunk by chunk, so memory use does not grow with
+// the number of effects
+// @return the status, see prepare_status; no file is written unless it
+// is PREPARE_OK
+inline int
+write_prepared_data(const std::string & path, const PrepareInput & in,
+                    PrepareSummary & sm)
+{
+	prepare_scan(in, sm);
+	int status = prepare_status(sm);
+	if (status != PREPARE_OK) return status;
+	FILE * f = std::fopen(path.c_str(), "wb");
+	if (f == NULL) throw std::runtime_error("cannot open " + path + " for writing");
+
+	MashFileHeader head;
+	std::memcpy(head.magic, MASH_FILE_MAGIC, sizeof(head.magic));
+	head.J        = in.J;
+	head.R        = in.R;
+	head.alpha    = in.alpha;
+	head.flags    = (sm.n_na > 0) ? MASH_FILE_MISSING : 0;
+	head.reserved = 0;
+	bool has_missing = sm.n_na > 0;
+	bool ok          = std::fwrite(&head, sizeof(head), 1, f) == 1;
+
+	bool finite_df = has_finite_df(in);
+	uword chunk    = std::max((uword) 1, MASH_FILE_CHUNK / std::max(in.R, (uword) 1));
+	uword block    = std::max((uword) 1, get_block_size(in.R));
+	size_t rsize   = mash_record_size(in.R, has_missing);
+	// chunk X R column-major buffers, and the records they become
+	mat b_buf(chunk, in.R), s_buf(chunk, in.R), sa_buf(chunk, in.R);
+	std::vector<int> m_buf(has_missing ? chunk * in.R : 0);
+	std::vector<char> records(chunk * rsize);
+	for (uword c0 = 0; ok && c0 < in.J; c0 += chunk) {
+		uword c1      = std::min(in.J, c0 + chunk);
+		uword nblocks = (c1 - c0 + block - 1) / block;
+	#pragma \
+		omp parallel for schedule(static) default(none) shared(in, sm, finite_df, c0, c1, chunk, block, nblocks, b_buf, s_buf, sa_buf, m_buf, has_missing)
+		for (uword k = 0; k < nblocks; ++k) {
+			uword j0 = c0 + k * block, j1 = std::min(c1, j0 + block);
+			uword o  = j0 - c0;
+			prepare_block(in, sm, finite_df, j0, j1, chunk, b_buf.memptr() + o,
+			              s_buf.memptr() + o, sa_buf.memptr() + o,
+			              has_missing ? &m_buf[o] : NULL);
+		}
+		for (uword j = 0; j < c1 - c0; ++j) {
+			char * rec = &records[j * rsize];
+			double * d = reinterpret_cast<double *>(rec);
+			for (uword r = 0; r < in.R; ++r) {
+				d[r]            = b_buf.at(j, r);
+				d[in.R + r]     = s_buf.at(j, r);
+				d[2 * in.R + r] = sa_buf.at(j, r);
+			}
+			if (has_missing)
+				for (uword r = 0; r < in.R; ++r)
+					rec[3 * in.R * sizeof(double) + r] = (char) m_buf[j + r * chunk];
+		}
+		ok = std::fwrite(&records[0], rsize, c1 - c0, f) == c1 - c0;
+	}
+	ok = (std::fclose(f) == 0) && ok;
+	if (!ok) throw std::runtime_error("cannot write " + path);
+	return status;
+}
+
+// MASHDATAREADER CLASS
+// --------------------
+// @title Random access to a file of prepared data
+// @description reads ranges of effects into R X n matrices, the layout
+// used by the C++ engines
+class MashDataReader
+{
+public:
+explicit MashDataReader(const std::string & path) : path(path)
+{
+	f = std::fopen(path.c_str(), "rb");
+	if (f == NULL) throw std::runtime_error("cannot open " + path);
+	if (std::fread(&head, sizeof(head), 1, f) != 1 ||
+	    std::memcmp(head.magic, MASH_FILE_MAGIC, sizeof(head.magic)) != 0) {
+		std::fclose(f);
+		throw std::runtime_error(path + " is not a mash data file");
+	}
+}
+
+~MashDataReader(){
+	std::fclose(f);
+}
+
+uword
+n_effects() const
+{
+	return head.J;
+}
+
+uword
+n_conditions() const
+{
+	return head.R;
+}
+
+double
+alpha() const
+{
+	return head.alpha;
+}
+
+bool
+has_missing() const
+{
+	return head.flags & MASH_FILE_MISSING;
+}
+
+// @title Read effects j0, ..., j0 + n - 1
+// @param m_mat the R X n missing mask, left empty when the file has none
+void
+read(uword j0, uword n, mat & b_mat, mat & s_mat, mat & s_alpha_mat,
+     arma::umat & m_mat)
+{
+	if (j0 + n > head.J) throw std::out_of_range("effects out of range in " + path);
+	uword R      = head.R;
+	size_t rsize = mash_record_size(R, has_missing());
+	std::vector<char> records(n * rsize);
+	if (n > 0 && (mash_fseek(f, sizeof(head) + (uint64_t) j0 * rsize) != 0 ||
+	              std::fread(&records[0], rsize, n, f) != n))
+		throw std::runtime_error("cannot read " + path);
+	b_mat.set_size(R, n);
+	s_mat.set_size(R, n);
+	s_alpha_mat.set_size(R, n);
+	if (has_missing()) m_mat.set_size(R, n);
+	else m_mat.reset();
+	for (uword j = 0; j < n; ++j) {
+		const char * rec = &records[j * rsize];
+		std::memcpy(b_mat.colptr(j), rec, R * sizeof(double));
+		std::memcpy(s_mat.colptr(j), rec + R * sizeof(double), R * sizeof(double));
+		std::memcpy(s_alpha_mat.colptr(j), rec + 2 * R * sizeof(double), R * sizeof(double));
+		if (has_missing())
+			for (uword r = 0; r < R; ++r) m_mat.at(r, j) = rec[3 * R * sizeof(double) + r];
+	}
+}
+
+private:
+std::string path;
+FILE * f;
+MashFileHeader head;
+};
+
+// RESULT FILES
+// ------------
+// A 48 byte header: the magic "MASHRES1", uint64 J and R and three
+// reserved uint64, followed by one record per effect,
+//   R doubles PosteriorMean, PosteriorSD, lfsr and NegativeProb, 1 double loglik
+// in the byte order of the host.
+const char MASH_RESULT_MAGIC[8] = { 'M', 'A', 'S', 'H', 'R', 'E', 'S', '1' };
+
+struct MashResultHeader
+{
+	char magic[8];
+	uint64_t J;
+	uint64_t R;
+	uint64_t reserved[3];
+};
+
+inline size_t
+mash_result_size(uint64_t R)
+{
+	return (4 * R + 1) * sizeof(double);
+}
+
+// MASHRESULTWRITER CLASS
+// ----------------------
+// @title Append the results of consecutive effects to a file
+class MashResultWriter
+{
+public:
+MashResultWriter(const std::string & path, uword J, uword R) : path(path)
+{
+	f = std::fopen(path.c_str(), "wb");
+	if (f == NULL) throw std::runtime_error("cannot open " + path + " for writing");
+	MashResultHeader head;
+	std::memset(&head, 0, sizeof(head));
+	std::memcpy(head.magic, MASH_RESULT_MAGIC, sizeof(head.magic));
+	head.J = J;
+	head.R = R;
+	if (std::fwrite(&head, sizeof(head), 1, f) != 1) {
+		std::fclose(f);
+		f = NULL;
+		fail();
+	}
+}
+
+~MashResultWriter(){
+	if (f != NULL) std::fclose(f);
+}
+
+// @title Write the results of the effects of a fitted problem
+// @param loglik the log-likelihood of each effect
+void
+write(const MashProblem & pb, const vec & loglik)
+{
+	uword R = pb.post_mean.n_rows, n = pb.post_mean.n_cols;
+	std::vector<double> records(n * (4 * R + 1));
+	for (uword j = 0; j < n; ++j) {
+		double * d = &records[j * (4 * R + 1)];
+		std::memcpy(d, pb.post_mean.colptr(j), R * sizeof(double));
+		std::memcpy(d + R, pb.post_sd.colptr(j), R * sizeof(double));
+		std::memcpy(d + 2 * R, pb.lfsr.colptr(j), R * sizeof(double));
+		std::memcpy(d + 3 * R, pb.neg_prob.colptr(j), R * sizeof(double));
+		d[4 * R] = loglik.at(j);
+	}
+	if (n > 0 && std::fwrite(&records[0], mash_result_size(R), n, f) != n) fail();
+}
+
+void
+close()
+{
+	int status = std::fclose(f);
+	f = NULL;
+	if (status != 0) fail();
+}
+
+private:
+std::string path;
+FILE * f;
+
+void
+fail()
+{
+	throw std::runtime_error("cannot write " + path);
+}
+};
+
+// MASHRESULTREADER CLASS
+// ----------------------
+// @title Random access to a file of results
+class MashResultReader
+{
+public:
+explicit MashResultReader(const std::string & path) : path(path)
+{
+	f = std::fopen(path.c_str(), "rb");
+	if (f == NULL) throw std::runtime_error("cannot open " + path);
+	if (std::fread(&head, sizeof(head), 1, f) != 1 ||
+	    std::memcmp(head.magic, MASH_RESULT_MAGIC, sizeof(head.magic)) != 0) {
+		std::fclose(f);
+		throw std::runtime_error(path + " is not a mash result file");
+	}
+}
+
+~MashResultReader(){
+	std::fclose(f);
+}
+
+uword
+n_effects() const
+{
+	return head.J;
+}
+
+uword
+n_conditions() const
+{
+	return head.R;
+}
+
+// @title Read the results of effects j0, ..., j0 + n - 1 as R X n matrices
+void
+read(uword j0, uword n, mat & post_mean, mat & post_sd, mat & lfsr,
+     mat & neg_prob, vec & loglik)
+{
+	if (j0 + n > head.J) throw std::out_of_range("effects out of range in " + path);
+	uword R = head.R;
+	std::vector<double> records(n * (4 * R + 1));
+	if (n > 0 && (mash_fseek(f, sizeof(head) + (uint64_t) j0 * mash_result_size(R)) != 0 ||
+	              std::fread(&records[0], mash_result_size(R), n, f) != n))
+		throw std::runtime_error("cannot read " + path);
+	post_mean.set_size(R, n);
+	post_sd.set_size(R, n);
+	lfsr.set_size(R, n);
+	neg_prob.set_size(R, n);
+	loglik.set_size(n);
+	for (uword j = 0; j < n; ++j) {
+		const double * d = &records[j * (4 * R + 1)];
+		std::memcpy(post_mean.colptr(j), d, R * sizeof(double));
+		std::memcpy(post_sd.colptr(j), d + R, R * sizeof(double));
+		std::memcpy(lfsr.colptr(j), d + 2 * R, R * sizeof(double));
+		std::memcpy(neg_prob.colptr(j), d + 3 * R, R * sizeof(double));
+		loglik.at(j) = d[4 * R];
+	}
+}
+
+private:
+std::string path;
+FILE * f;
+MashResultHeader head;
+};
+
+// COMPACT RESULT FILES
+// --------------------
+// A 64 byte header: the magic "MASHRES2", uint64 J, R and the number of
+// effects per chunk, uint32 flags (MASH_COMPACT_*), the uint32 encodings
+// of the standard deviations and of the probabilities (lfsr,
+// NegativeProb and lfdr), a reserved uint32, the uint64 offset of the
+// name index (0 if there is none) and a reserved uint64. The effects
+// follow in chunks, every one but the last of the same size. A chunk of
+// n effects holds, one field after another, the PosteriorMean (double),
+// PosteriorSD, lfsr, NegativeProb and, if flagged, lfdr, each as R runs
+// of n values, one run per condition, and then, if flagged, the n
+// log-likelihoods (double). A condition of a range of effects is thus
+// read with one contiguous read per chunk and field, and an effect
+// without reading more than its chunk.
+// The name index holds uint64 offsets[J + R + 1] into the names that end
+// it, the effect names and then the condition names, and uint64
+// order[J], the effects in increasing (bytewise) order of their names,
+// so an effect is found by name with a binary search on disk.
+// Everything is in the byte order of the host.
+const char MASH_COMPACT_MAGIC[8] = { 'M', 'A', 'S', 'H', 'R', 'E', 'S', '2' };
+const uint32_t MASH_COMPACT_LFDR   = 1;
+const uint32_t MASH_COMPACT_LOGLIK = 2;
+// encodings: probabilities may be quantised to 16 bits, in steps of
+// 1/65534, with 65535 standing for NaN
+const uint32_t MASH_ENC_DOUBLE = 0;
+const uint32_t MASH_ENC_FLOAT  = 1;
+const uint32_t MASH_ENC_UINT16 = 2;
+
+struct MashCompactHeader
+{
+	char magic[8];
+	uint64_t J;
+	uint64_t R;
+	uint64_t chunk;
+	uint32_t flags;
+	uint32_t enc_sd;
+	uint32_t enc_prob;
+	uint32_t reserved32;
+	uint64_t index_offset;
+	uint64_t reserved;
+};
+
+struct MashCompactOptions
+{
+	uword chunk;
+	uint32_t enc_sd;
+	uint32_t enc_prob;
+	bool lfdr;
+};
+
+inline size_t
+mash_enc_width(uint32_t enc)
+{
+	return (enc == MASH_ENC_DOUBLE) ? 8 : (enc == MASH_ENC_FLOAT) ? 4 : 2;
+}
+
+inline void
+mash_encode(uint32_t enc, double x, char * p)
+{
+	if (enc == MASH_ENC_DOUBLE) {
+		std::memcpy(p, &x, sizeof(x));
+	} else if (enc == MASH_ENC_FLOAT) {
+		float y = (float) x;
+		std::memcpy(p, &y, sizeof(y));
+	} else {
+		uint16_t q = 65535;
+		if (!std::isnan(x)) q = (uint16_t) std::floor(std::min(std::max(x, 0.0), 1.0) * 65534 + 0.5);
+		std::memcpy(p, &q, sizeof(q));
+	}
+}
+
+inline double
+mash_decode(uint32_t enc, const char * p)
+{
+	if (enc == MASH_ENC_DOUBLE) {
+		double x;
+		std::memcpy(&x, p, sizeof(x));
+		return x;
+	} else if (enc == MASH_ENC_FLOAT) {
+		float y;
+		std::memcpy(&y, p, sizeof(y));
+		return y;
+	}
+	uint16_t q;
+	std::memcpy(&q, p, sizeof(q));
+	return (q == 65535) ? datum::nan : q / 65534.0;
+}
+
+// the fields of a chunk, in the order they are stored
+enum MashCompactField
+{
+	MASH_FIELD_MEAN, MASH_FIELD_SD, MASH_FIELD_LFSR, MASH_FIELD_NEG, MASH_FIELD_LFDR,
+	MASH_N_FIELDS
+};
+
+// @title Where the fields of the chunks of a compact file are
+class MashCompactLayout
+{
+public:
+MashCompactLayout() {}
+
+explicit MashCompactLayout(const MashCompactHeader & head) : head(head) {}
+
+bool
+has(int field) const
+{
+	return field != MASH_FIELD_LFDR || (head.flags & MASH_COMPACT_LFDR);
+}
+
+size_t
+width(int field) const
+{
+	if (field == MASH_FIELD_MEAN) return sizeof(double);
+	if (field == MASH_FIELD_SD) return mash_enc_width(head.enc_sd);
+	return mash_enc_width(head.enc_prob);
+}
+
+uint32_t
+encoding(int field) const
+{
+	if (field == MASH_FIELD_MEAN) return MASH_ENC_DOUBLE;
+	if (field == MASH_FIELD_SD) return head.enc_sd;
+	return head.enc_prob;
+}
+
+// @return the number of effects in chunk k
+uword
+chunk_size(uword k) const
+{
+	return std::min((uword) head.chunk, (uword) head.J - k * head.chunk);
+}
+
+// @return the bytes of a chunk of n effects
+uint64_t
+chunk_bytes(uword n) const
+{
+	uint64_t bytes = 0;
+	for (int f = 0; f < MASH_N_FIELDS; ++f)
+		if (has(f)) bytes += (uint64_t) head.R * n * width(f);
+	if (head.flags & MASH_COMPACT_LOGLIK) bytes += (uint64_t) n * sizeof(double);
+	return bytes;
+}
+
+// @return the offset of the run of condition r of field f in chunk k;
+// the log-likelihoods are field MASH_N_FIELDS, with r = 0
+uint64_t
+offset(uword k, int field, uword r) const
+{
+	uword n      = chunk_size(k);
+	uint64_t pos = sizeof(MashCompactHeader) + (uint64_t) k * chunk_bytes(head.chunk);
+	for (int f = 0; f < field; ++f)
+		if (has(f)) pos += (uint64_t) head.R * n * width(f);
+	if (field < MASH_N_FIELDS) pos += (uint64_t) r * n * width(field);
+	return pos;
+}
+
+private:
+MashCompactHeader head;
+};
+
+// @return whether the file starts as a compact result file does
+inline bool
+is_compact_result_file(const std::string & path)
+{
+	char magic[8];
+	FILE * f = std::fopen(path.c_str(), "rb");
+	if (f == NULL) return false;
+	bool ok = std::fread(magic, sizeof(magic), 1, f) == 1 &&
+	          std::memcmp(magic, MASH_COMPACT_MAGIC, sizeof(magic)) == 0;
+	std::fclose(f);
+	return ok;
+}
+
+// MASHCOMPACTWRITER CLASS
+// -----------------------
+// @title Append the results of consecutive effects to a compact file
+// @description effects are buffered until a chunk is full; close writes
+// the last chunk and the name index
+class MashCompactWriter
+{
+public:
+MashCompactWriter(const std::string & path, uword J, uword R,
+                  const MashCompactOptions & opt, bool loglik) :
+	path(path), J(J), R(R), n_written(0), n_buf(0)
+{
+	if (opt.enc_sd > MASH_ENC_FLOAT || opt.enc_prob > MASH_ENC_UINT16)
+		throw std::invalid_argument("unknown encoding");
+	std::memset(&head, 0, sizeof(head));
+	std::memcpy(head.magic, MASH_COMPACT_MAGIC, sizeof(head.magic));
+	head.J        = J;
+	head.R        = R;
+	head.chunk    = std::max(opt.chunk, (uword) 1);
+	head.flags    = (opt.lfdr ? MASH_COMPACT_LFDR : 0) | (loglik ? MASH_COMPACT_LOGLIK : 0);
+	head.enc_sd   = opt.enc_sd;
+	head.enc_prob = opt.enc_prob;
+	layout        = MashCompactLayout(head);
+	for (int f = 0; f < MASH_N_FIELDS; ++f)
+		if (layout.has(f)) buf[f].set_size(R, head.chunk);
+	loglik_buf.set_size(head.chunk);
+	f = std::fopen(path.c_str(), "wb");
+	if (f == NULL) throw std::runtime_error("cannot open " + path + " for writing");
+	if (std::fwrite(&head, sizeof(head), 1, f) != 1) {
+		std::fclose(f);
+		f = NULL;
+		fail();
+	}
+}
+
+~MashCompactWriter(){
+	if (f != NULL) std::fclose(f);
+}
+
+// @title Append n effects, given as R X n matrices
+// @param lfdr ignored unless the file has lfdr
+// @param loglik ignored unless the file has log-likelihoods
+void
+append(const mat & mean, const mat & sd, const mat & lfsr, const mat & neg,
+       const mat & lfdr, const vec & loglik)
+{
+	const mat * src[MASH_N_FIELDS] = { &mean, &sd, &lfsr, &neg, &lfdr };
+	uword n = mean.n_cols;
+	if (n_written + n_buf + n > J) throw std::out_of_range("more effects than declared in " + path);
+	for (uword j = 0; j < n; ) {
+		uword m = std::min(n - j, (uword) head.chunk - n_buf);
+		for (int fi = 0; fi < MASH_N_FIELDS; ++fi)
+			if (layout.has(fi)) buf[fi].cols(n_buf, n_buf + m - 1) = src[fi]->cols(j, j + m - 1);
+		if (head.flags & MASH_COMPACT_LOGLIK)
+			loglik_buf.subvec(n_buf, n_buf + m - 1) = loglik.subvec(j, j + m - 1);
+		n_buf += m;
+		j     += m;
+		if (n_buf == head.chunk) flush();
+	}
+}
+
+// @title Write the results of the effects of a fitted problem
+void
+write(const MashProblem & pb, const vec & loglik)
+{
+	append(pb.post_mean, pb.post_sd, pb.lfsr, pb.neg_prob, pb.zero_prob, loglik);
+}
+
+// @param names the J effect names followed by the R condition names, or
+// none for a file without a name index
+void
+close(const std::vector<std::string> & names = std::vector<std::string>())
+{
+	if (n_buf > 0) flush();
+	if (n_written != J) throw std::runtime_error("fewer effects than declared in " + path);
+	if (!names.empty()) write_index(names);
+	int status = std::fclose(f);
+	f = NULL;
+	if (status != 0) fail();
+}
+
+private:
+std::string path;
+uword J;
+uword R;
+uword n_written;
+uword n_buf;
+FILE * f;
+MashCompactHeader head;
+MashCompactLayout layout;
+mat buf[MASH_N_FIELDS];
+vec loglik_buf;
+
+void
+fail()
+{
+	throw std::runtime_error("cannot write " + path);
+}
+
+void
+flush()
+{
+	std::vector<char> bytes(layout.chunk_bytes(n_buf));
+	char * p = bytes.empty() ? NULL : &bytes[0];
+	for (int fi = 0; fi < MASH_N_FIELDS; ++fi) {
+		if (!layout.has(fi)) continue;
+		uint32_t enc = layout.encoding(fi);
+		size_t w     = layout.width(fi);
+		for (uword r = 0; r < R; ++r)
+			for (uword j = 0; j < n_buf; ++j, p += w) mash_encode(enc, buf[fi].at(r, j), p);
+	}
+	if (head.flags & MASH_COMPACT_LOGLIK)
+		for (uword j = 0; j < n_buf; ++j, p += sizeof(double))
+			mash_encode(MASH_ENC_DOUBLE, loglik_buf.at(j), p);
+	if (!bytes.empty() && std::fwrite(&bytes[0], bytes.size(), 1, f) != 1) fail();
+	n_written += n_buf;
+	n_buf      = 0;
+}
+
+void
+write_index(const std::vector<std::string> & names)
+{
+	if (names.size() != J + R) throw std::invalid_argument("there should be a name per effect and condition");
+	std::vector<uint64_t> offsets(J + R + 1, 0), order(J);
+	for (uword i = 0; i < J + R; ++i) offsets[i + 1] = offsets[i] + names[i].size();
+	for (uword j = 0; j < J; ++j) order[j] = j;
+	std::stable_sort(order.begin(), order.end(), [&names](uint64_t a, uint64_t b) {
+		return names[a] < names[b];
+	});
+	bool ok = mash_fseek(f, 0) == 0;
+	head.index_offset = sizeof(head) + (uint64_t) (J / head.chunk) * layout.chunk_bytes(head.chunk)
+	                    + ((J % head.chunk) ? layout.chunk_bytes(J % head.chunk) : 0);
+	ok = ok && std::fwrite(&head, sizeof(head), 1, f) == 1;
+	ok = ok && mash_fseek(f, head.index_offset) == 0;
+	ok = ok && std::fwrite(&offsets[0], sizeof(uint64_t), offsets.size(), f) == offsets.size();
+	if (J > 0) ok = ok && std::fwrite(&order[0], sizeof(uint64_t), J, f) == J;
+	for (uword i = 0; ok && i < J + R; ++i)
+		if (!names[i].empty()) ok = std::fwrite(names[i].data(), names[i].size(), 1, f) == 1;
+	if (!ok) fail();
+}
+};
+
+// MASHCOMPACTREADER CLASS
+// -----------------------
+// @title Random access to a compact file of results
+class MashCompactReader
+{
+public:
+explicit MashCompactReader(const std::string & path) : path(path)
+{
+	f = std::fopen(path.c_str(), "rb");
+	if (f == NULL) throw std::runtime_error("cannot open " + path);
+	if (std::fread(&head, sizeof(head), 1, f) != 1 ||
+	    std::memcmp(head.magic, MASH_COMPACT_MAGIC, sizeof(head.magic)) != 0) {
+		std::fclose(f);
+		throw std::runtime_error(path + " is not a compact mash result file");
+	}
+	layout = MashCompactLayout(head);
+}
+
+~MashCompactReader(){
+	std::fclose(f);
+}
+
+uword
+n_effects() const
+{
+	return head.J;
+}
+
+uword
+n_conditions() const
+{
+	return head.R;
+}
+
+bool
+has_lfdr() const
+{
+	return head.flags & MASH_COMPACT_LFDR;
+}
+
+bool
+has_loglik() const
+{
+	return head.flags & MASH_COMPACT_LOGLIK;
+}
+
+bool
+has_names() const
+{
+	return head.index_offset != 0;
+}
+
+// @title Name i: effect i for i < J, condition i - J after
+std::string
+name(uword i)
+{
+	uint64_t range[2];
+	read_at(head.index_offset + i * sizeof(uint64_t), range, sizeof(range));
+	std::string s(range[1] - range[0], '\0');
+	if (!s.empty())
+		read_at(names_offset() + range[0], &s[0], s.size());
+	return s;
+}
+
+// @title Find an effect by name
+// @return false if there is no effect of that name
+bool
+find(const std::string & key, uword & j)
+{
+	if (!has_names()) return false;
+	uint64_t lo = 0, hi = head.J;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2, e;
+		read_at(head.index_offset + (head.J + head.R + 1 + mid) * sizeof(uint64_t), &e, sizeof(e));
+		if (name(e) < key) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == head.J) return false;
+	uint64_t e;
+	read_at(head.index_offset + (head.J + head.R + 1 + lo) * sizeof(uint64_t), &e, sizeof(e));
+	j = e;
+	return name(e) == key;
+}
+
+// @title Read some effects in some conditions
+// @description reads, chunk by chunk, only the chunks that hold the
+// effects and in them only the runs of the conditions, merging the runs
+// of consecutive conditions into one read
+// @param effects the effects, in any order
+// @param conds the conditions, in any order
+// @param out output, the |conds| X |effects| matrices of each field;
+// those the file does not have are left empty
+// @param loglik output, left empty if the file has none
+void
+read(const uvec & effects, const uvec & conds, mat out[MASH_N_FIELDS], vec & loglik)
+{
+	if (arma::any(effects >= head.J) || arma::any(conds >= head.R))
+		throw std::out_of_range("effects or conditions out of range in " + path);
+	uword n = effects.n_elem;
+	for (int fi = 0; fi < MASH_N_FIELDS; ++fi) {
+		if (layout.has(fi)) out[fi].set_size(conds.n_elem, n);
+		else out[fi].reset();
+	}
+	if (has_loglik()) loglik.set_size(n);
+	else loglik.reset();
+	uvec by_effect = arma::stable_sort_index(effects);
+	uvec by_cond   = arma::stable_sort_index(conds);
+	std::vector<char> bytes;
+	for (uword i0 = 0; i0 < n; ) {
+		// the effects of this chunk
+		uword k  = effects.at(by_effect.at(i0)) / head.chunk;
+		uword i1 = i0;
+		while (i1 < n && effects.at(by_effect.at(i1)) / head.chunk == k) ++i1;
+		uword nk = layout.chunk_size(k);
+		for (int fi = 0; fi < MASH_N_FIELDS; ++fi) {
+			if (!layout.has(fi)) continue;
+			size_t w     = layout.width(fi);
+			uint32_t enc = layout.encoding(fi);
+			for (uword c0 = 0; c0 < conds.n_elem; ) {
+				// consecutive conditions are read at once
+				uword c1 = c0 + 1;
+				while (c1 < conds.n_elem &&
+				       conds.at(by_cond.at(c1)) <= conds.at(by_cond.at(c1 - 1)) + 1) ++c1;
+				uword r0 = conds.at(by_cond.at(c0)), r1 = conds.at(by_cond.at(c1 - 1));
+				bytes.resize((r1 - r0 + 1) * nk * w);
+				read_at(layout.offset(k, fi, r0), &bytes[0], bytes.size());
+				for (uword c = c0; c < c1; ++c) {
+					uword r = conds.at(by_cond.at(c));
+					const char * run = &bytes[(r - r0) * nk * w];
+					for (uword i = i0; i < i1; ++i) {
+						uword e = by_effect.at(i);
+						out[fi].at(by_cond.at(c), e) =
+							mash_decode(enc, run + (effects.at(e) - k * head.chunk) * w);
+					}
+				}
+				c0 = c1;
+			}
+		}
+		if (has_loglik()) {
+			bytes.resize(nk * sizeof(double));
+			read_at(layout.offset(k, MASH_N_FIELDS, 0), &bytes[0], bytes.size());
+			for (uword i = i0; i < i1; ++i) {
+				uword e = by_effect.at(i);
+				loglik.at(e) = mash_decode(MASH_ENC_DOUBLE,
+				                           &bytes[(effects.at(e) - k * head.chunk) * sizeof(double)]);
+			}
+		}
+		i0 = i1;
+	}
+}
+
+private:
+std::string path;
+FILE * f;
+MashCompactHeader head;
+MashCompactLayout layout;
+
+uint64_t
+names_offset() const
+{
+	return head.index_offset + (2 * head.J + head.R + 1) * sizeof(uint64_t);
+}
+
+void
+read_at(uint64_t offset, void * p, size_t bytes)
+{
+	if (bytes > 0 && (mash_fseek(f, offset) != 0 || std::fread(p, bytes, 1, f) != 1))
+		throw std::runtime_error("cannot read " + path);
+}
+};
+
+// MAPPEDMATRIX CLASS
+// ------------------
+// @title A read-only matrix stored in a file
+// @description the file holds the n_rows X n_cols doubles of the matrix
+// in column-major order and nothing else, as written by writeBin. It is
+// memory-mapped where possible, so the pages are read as they are used
+// and shared with other processes; on Windows it is read into memory.
+class MappedMatrix
+{
+public:
+MappedMatrix(const std::string & path, uword n_rows, uword n_cols) :
+	n_rows(n_rows), n_cols(n_cols), addr(NULL), bytes((size_t) n_rows * n_cols * sizeof(double))
+{
+	#ifndef _WIN32
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) throw std::runtime_error("cannot open " + path);
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size != bytes) {
+		::close(fd);
+		throw std::runtime_error(path + " does not hold a matrix of the given size");
+	}
+	if (bytes > 0) {
+		addr = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) addr = NULL;
+	}
+	::close(fd);
+	if (addr == NULL && bytes > 0) throw std::runtime_error("cannot map " + path);
+	#else
+	copy.set_size(n_rows, n_cols);
+	FILE * f = std::fopen(path.c_str(), "rb");
+	if (f == NULL) throw std::runtime_error("cannot open " + path);
+	bool ok = std::fread(copy.memptr(), sizeof(double), copy.n_elem, f) == copy.n_elem
+	          && std::fgetc(f) == EOF;
+	std::fclose(f);
+	if (!ok) throw std::runtime_error(path + " does not hold a matrix of the given size");
+	addr = copy.memptr();
+	#endif
+}
+
+~MappedMatrix(){
+	#ifndef _WIN32
+	if (addr != NULL) munmap(addr, bytes);
+	#endif
+}
+
+// @return the matrix, using the mapped memory without a copy
+mat
+get() const
+{
+	if (addr == NULL) return mat(n_rows, n_cols);
+	return mat(static_cast<double *>(addr), n_rows, n_cols, false, true);
+}
+
+private:
+uword n_rows;
+uword n_cols;
+void * addr;
+size_t bytes;
+mat copy;
+MappedMatrix(const MappedMatrix &);
+MappedMatrix & operator=(const MappedMatrix &);
+};
+
+#endif // _MASH_IO_H
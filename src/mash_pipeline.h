@@ -0,0 +1,318 @@
+// Pipelined posterior computation over a file of prepared data
+#ifndef _MASH_PIPELINE_H
+#define _MASH_PIPELINE_H
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "mash_io.h"
+
+// BOUNDEDQUEUE CLASS
+// ------------------
+// @title A queue between pipeline stages
+// @description push blocks while the queue holds capacity items, so a
+// fast producer waits for its consumers instead of filling memory. Once
+// closed, push fails and pop drains what is left and then fails.
+template <typename T>
+class BoundedQueue
+{
+public:
+explicit BoundedQueue(size_t capacity) : capacity(std::max(capacity, (size_t) 1)), closed(false) {}
+
+bool
+push(T && item)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	not_full.wait(lock, [this]() {
+		return closed || items.size() < capacity;
+	});
+	if (closed) return false;
+	items.push_back(std::move(item));
+	not_empty.notify_one();
+	return true;
+}
+
+bool
+pop(T & item)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	not_empty.wait(lock, [this]() {
+		return closed || !items.empty();
+	});
+	if (items.empty()) return false;
+	item = std::move(items.front());
+	items.pop_front();
+	not_full.notify_one();
+	return true;
+}
+
+void
+close()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	closed = true;
+	not_full.notify_all();
+	not_empty.notify_all();
+}
+
+private:
+size_t capacity;
+bool closed;
+std::deque<T> items;
+std::mutex mutex;
+std::condition_variable not_full;
+std::condition_variable not_empty;
+};
+
+// PIPELINE
+// --------
+// A chunk of consecutive effects on its way through the pipeline
+struct PipelineChunk
+{
+	uword index;
+	MashProblem pb;
+	vec loglik;
+};
+
+struct PipelineStats
+{
+	uword n_chunks;
+	uword max_in_flight;
+	double wall;       // seconds
+	double read;       // seconds the reader spent reading
+	double compute;    // seconds the workers spent computing, summed
+	double write;      // seconds the writer spent writing
+};
+
+// MASHPIPELINE CLASS
+// ------------------
+// @title Posterior summaries of a data file under a fitted model
+// @description a reader thread reads chunks of effects from a file
+// written by write_prepared_data, n_workers threads each compute the
+// likelihoods, posterior weights and posterior summaries of a chunk, and
+// a writer thread writes the results in order with MashResultWriter, or
+// MashCompactWriter when compact options are given. The
+// stages overlap: chunks are read ahead while others are computed and
+// written. At most `depth` chunks are in flight between being read and
+// written, which bounds the memory whatever the relative speed of the
+// stages. An error in any stage closes the queues and is rethrown.
+// @param U_cube R x R x P scaled prior covariances
+// @param pi P mixture proportions
+// @param v_mat R x R correlation of the errors
+class MashPipeline
+{
+public:
+MashPipeline(const cube & U_cube, const vec & pi, const mat & v_mat,
+             double pi_thresh, uword chunk_size, int n_workers, uword depth) :
+	U_cube(U_cube), pi(pi), v_mat(v_mat), pi_thresh(pi_thresh),
+	chunk_size(std::max(chunk_size, (uword) 1)),
+	n_workers(std::max(n_workers, 1)),
+	depth(std::max(depth, (uword) n_workers + 1)),
+	in_queue(this->depth), out_queue(this->depth), in_flight(0), failed(false)
+{
+	stats.n_chunks      = 0;
+	stats.max_in_flight = 0;
+	stats.read          = 0;
+	stats.compute       = 0;
+	stats.write         = 0;
+}
+
+PipelineStats
+run(const std::string & in_path, const std::string & out_path,
+    const MashCompactOptions * compact = NULL)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	MashDataReader reader(in_path);
+	if (reader.n_conditions() != v_mat.n_rows)
+		throw std::invalid_argument("the data and the model have different conditions");
+	if (compact != NULL) {
+		MashCompactWriter writer(out_path, reader.n_effects(), reader.n_conditions(),
+		                         *compact, true);
+		return run_stages(reader, writer, start);
+	}
+	MashResultWriter writer(out_path, reader.n_effects(), reader.n_conditions());
+	return run_stages(reader, writer, start);
+}
+
+private:
+const cube & U_cube;
+const vec & pi;
+const mat & v_mat;
+double pi_thresh;
+uword chunk_size;
+int n_workers;
+uword depth;
+BoundedQueue<PipelineChunk> in_queue;
+BoundedQueue<PipelineChunk> out_queue;
+// chunks read and not yet written
+uword in_flight;
+std::mutex flight_mutex;
+std::condition_variable flight_cv;
+std::atomic<bool> failed;
+std::mutex error_mutex;
+std::exception_ptr error;
+PipelineStats stats;
+
+template <typename W>
+PipelineStats
+run_stages(MashDataReader & reader, W & writer,
+           std::chrono::steady_clock::time_point start)
+{
+	std::vector<std::thread> threads;
+	threads.push_back(std::thread([&]() {
+		guard([&]() {
+			read_stage(reader);
+		});
+		in_queue.close();
+	}));
+	std::vector<double> busy(n_workers, 0);
+	for (int i = 0; i < n_workers; ++i)
+		threads.push_back(std::thread([&, i]() {
+			#ifdef _OPENMP
+			omp_set_num_threads(1);
+			#endif
+			guard([&]() {
+				busy[i] = compute_stage();
+			});
+		}));
+	threads.push_back(std::thread([&]() {
+		guard([&]() {
+			write_stage(writer);
+		});
+	}));
+	// the writer stops when every worker has finished
+	for (int i = 1; i <= n_workers; ++i) threads[i].join();
+	out_queue.close();
+	threads[0].join();
+	threads.back().join();
+	if (error) std::rethrow_exception(error);
+	if (!progress_cancelled()) writer.close();
+	for (int i = 0; i < n_workers; ++i) stats.compute += busy[i];
+	stats.wall = seconds_since(start);
+	return stats;
+}
+
+static double
+seconds_since(std::chrono::steady_clock::time_point t)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+bool
+stopped()
+{
+	return failed || progress_cancelled();
+}
+
+// closes the queues, so that every stage stops at its next push or pop
+void
+shutdown()
+{
+	in_queue.close();
+	out_queue.close();
+	std::lock_guard<std::mutex> lock(flight_mutex);
+	flight_cv.notify_all();
+}
+
+// runs a stage, and on error keeps the first exception and stops the
+// others; a stage that sees the pipeline stopped, by an error or by a
+// user interrupt, stops the others as well
+template <typename F>
+void
+guard(F f)
+{
+	try {
+		f();
+	} catch (...) {
+		std::lock_guard<std::mutex> lock(error_mutex);
+		if (!error) error = std::current_exception();
+		failed = true;
+	}
+	if (stopped()) shutdown();
+}
+
+void
+read_stage(MashDataReader & reader)
+{
+	uword J = reader.n_effects();
+	for (uword index = 0, j0 = 0; j0 < J && !stopped(); ++index, j0 += chunk_size) {
+		{
+			std::unique_lock<std::mutex> lock(flight_mutex);
+			// wakes up now and then to see a user interrupt
+			while (!stopped() && in_flight >= depth)
+				flight_cv.wait_for(lock, std::chrono::milliseconds(100));
+			if (stopped()) return;
+			++in_flight;
+			stats.max_in_flight = std::max(stats.max_in_flight, in_flight);
+		}
+		std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+		PipelineChunk chunk;
+		chunk.index = index;
+		arma::umat m_mat;
+		reader.read(j0, std::min(chunk_size, J - j0), chunk.pb.b_mat, chunk.pb.s_mat,
+		            chunk.pb.s_alpha_mat, m_mat);
+		chunk.pb.m_mat = arma::conv_to<mat>::from(m_mat);
+		stats.read += seconds_since(t);
+		if (!in_queue.push(std::move(chunk))) return;
+	}
+}
+
+// @return the seconds spent computing
+double
+compute_stage()
+{
+	double busy = 0;
+	PipelineChunk chunk;
+	while (!stopped() && in_queue.pop(chunk)) {
+		std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+		MashProblem & pb = chunk.pb;
+		pb.v_mat = v_mat;
+		pb.pi    = pi;
+		mat lik;
+		vec lfactors;
+		bool common_cov;
+		if (!mash_problem_lik(pb, U_cube, lik, lfactors, common_cov))
+			throw std::runtime_error(pb.message);
+		chunk.loglik = log(lik * pi) + lfactors - trans(sum(log(pb.s_alpha_mat), 0));
+		mash_problem_posterior(pb, U_cube, lik, pi_thresh);
+		progress_tick(pb.b_mat.n_cols);
+		// the inputs are not needed any more
+		pb.b_mat.reset();
+		pb.s_mat.reset();
+		busy += seconds_since(t);
+		if (!out_queue.push(std::move(chunk))) break;
+	}
+	return busy;
+}
+
+// writes the chunks in order, holding back those that finish early
+template <typename W>
+void
+write_stage(W & writer)
+{
+	std::map<uword, PipelineChunk> pending;
+	uword next = 0;
+	PipelineChunk chunk;
+	while (!stopped() && out_queue.pop(chunk)) {
+		pending.insert(std::make_pair(chunk.index, std::move(chunk)));
+		std::map<uword, PipelineChunk>::iterator it;
+		while ((it = pending.find(next)) != pending.end()) {
+			std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+			writer.write(it->second.pb, it->second.loglik);
+			stats.write += seconds_since(t);
+			pending.erase(it);
+			++next;
+			++stats.n_chunks;
+			std::lock_guard<std::mutex> lock(flight_mutex);
+			--in_flight;
+			flight_cv.notify_one();
+		}
+	}
+}
+};
+
+#endif // _MASH_PIPELINE_H
@@ -0,0 +1,448 @@
+// Local scoring server for fitted mash models
+#ifndef _MASH_SERVER_H
+#define _MASH_SERVER_H
+#ifndef _WIN32
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "mash.h"
+
+// PROTOCOL
+// --------
+// All integers are uint32 and all values doubles, in the byte order of
+// the host (the socket is local). A request is
+//   magic, model, n, R, then n x R Bhat and n x R Shat, effect by effect
+// and the response is
+//   magic, status, n, R, then n x R posterior mean, n x R posterior SD
+//   and n x R lfsr, effect by effect; only the header when status != 0.
+// A connection can carry any number of requests.
+const uint32_t SERVER_MAGIC      = 0x4853414d; // "MASH"
+const uint32_t SERVER_OK         = 0;
+const uint32_t SERVER_BAD_MAGIC  = 1;
+const uint32_t SERVER_BAD_MODEL  = 2;
+const uint32_t SERVER_BAD_DIM    = 3;
+const uint32_t SERVER_TOO_LARGE  = 4;
+const uint32_t SERVER_FAILED     = 5;
+const uint32_t SERVER_MAX_VALUES = 1u << 26;
+
+// a server read gives up after this long without any data
+const int SERVER_READ_TIMEOUT_MS = 30000;
+
+// reads or writes exactly n bytes; false on error or end of stream. With
+// running, the read waits for data in short polls, and gives up when
+// running is cleared or after timeout_ms without data, so that a stalled
+// client cannot hold the server
+inline bool
+read_full(int fd, void * buf, size_t n, const std::atomic<bool> * running = 0,
+          int timeout_ms = SERVER_READ_TIMEOUT_MS)
+{
+	char * p = static_cast<char *>(buf);
+	pollfd pfd;
+	pfd.fd     = fd;
+	pfd.events = POLLIN;
+	while (n > 0) {
+		if (running) {
+			int waited = 0, ready;
+			while ((ready = ::poll(&pfd, 1, 100)) == 0) {
+				waited += 100;
+				if (!*running || waited >= timeout_ms) return false;
+			}
+			if (ready < 0 && errno == EINTR) continue;
+			if (ready < 0) return false;
+		}
+		ssize_t k = ::read(fd, p, n);
+		if (k < 0 && errno == EINTR) continue;
+		if (k <= 0) return false;
+		p += k;
+		n -= k;
+	}
+	return true;
+}
+
+// writes to a closed connection fail with EPIPE rather than raising
+// SIGPIPE: through MSG_NOSIGNAL in write_full where it exists, and
+// otherwise (macOS) through SO_NOSIGPIPE on the socket
+inline void
+set_no_sigpipe(int fd)
+{
+	#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+	int one = 1;
+	::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+	#else
+	(void) fd;
+	#endif
+}
+
+inline bool
+write_full(int fd, const void * buf, size_t n)
+{
+	const char * p = static_cast<const char *>(buf);
+	int flags = 0;
+	#ifdef MSG_NOSIGNAL
+	flags = MSG_NOSIGNAL;
+	#endif
+	while (n > 0) {
+		ssize_t k = ::send(fd, p, n, flags);
+		if (k < 0 && errno == EINTR) continue;
+		if (k <= 0) return false;
+		p += k;
+		n -= k;
+	}
+	return true;
+}
+
+// SCORINGMODEL CLASS
+// ------------------
+// @title A fitted mash model ready for scoring
+// @description Holds the scaled prior covariances with non-negligible
+// weight, V and alpha. The factorisations for a pattern of standard
+// errors, the inverse Cholesky factors of the likelihood covariances and
+// the posterior factors of get_missing_factors, are computed on first
+// use and kept, so repeated standard errors cost no decompositions.
+// @param U_cube R x R x P scaled prior covariances
+// @param pi P mixture proportions
+// @param V R x R correlation of the errors
+// @param alpha the alpha of mash_set_data used to fit the model
+class ScoringModel
+{
+public:
+ScoringModel(const cube & U_cube, const vec & pi, const mat & V,
+             double alpha, double pi_thresh, size_t max_factors = 4096) :
+	V(V), alpha(alpha), max_factors(max_factors)
+{
+	uvec comp = find(pi > pi_thresh);
+	U.set_size(U_cube.n_rows, U_cube.n_cols, comp.n_elem);
+	for (uword k = 0; k < comp.n_elem; ++k) U.slice(k) = U_cube.slice(comp.at(k));
+	log_pi = log(pi.elem(comp));
+}
+
+~ScoringModel(){
+}
+
+uword
+n_conditions() const
+{
+	return V.n_rows;
+}
+
+// @title Posterior summaries for a batch of effects
+// @param bhat R x n effects, unscaled
+// @param shat R x n standard errors
+// @param post_mean, post_sd, lfsr R x n outputs
+void
+score(const mat & bhat, const mat & shat, mat & post_mean, mat & post_sd,
+      mat & lfsr) const
+{
+	uword R = bhat.n_rows, n = bhat.n_cols, P = U.n_slices;
+	// data as prepared by mash_set_data
+	mat s_alpha = pow(shat, alpha);
+	mat b_mat   = bhat / s_alpha;
+	mat s_mat   = shat / s_alpha;
+	SE s_obj;
+	s_obj.set(s_mat, s_alpha);
+	s_obj.set_original(mat());
+
+	mat llik(n, P);
+	std::vector<EffectGroup> groups = group_effects(s_mat, mat(), R);
+	std::vector<std::shared_ptr<const Factors> > factors(groups.size());
+	vec mean(R, arma::fill::zeros);
+	for (size_t g = 0; g < groups.size(); ++g) {
+		const uvec & idx = groups[g].effects;
+		factors[g] = get_factors(s_mat.col(idx.at(0)));
+		mat b_g = b_mat.cols(idx);
+		for (uword p = 0; p < P; ++p) {
+			if (!factors[g]->ok.at(p)) {
+				for (uword k = 0; k < idx.n_elem; ++k) llik.at(idx.at(k), p) = -datum::inf;
+				continue;
+			}
+			vec l = dmvnorm_mat(b_g, mean, factors[g]->rooti.slice(p), true, true);
+			for (uword k = 0; k < idx.n_elem; ++k) llik.at(idx.at(k), p) = l.at(k);
+		}
+	}
+	// P X n posterior weights
+	mat weights = trans(llik.each_row() + log_pi.t());
+	for (uword j = 0; j < n; ++j) weights.col(j) = softmax(weights.col(j));
+
+	mat post_var(R, n, arma::fill::zeros), neg_prob(R, n, arma::fill::zeros),
+	zero_prob(R, n, arma::fill::zeros);
+	cube post_cov;
+	post_mean.zeros(R, n);
+	for (size_t g = 0; g < groups.size(); ++g) {
+		for (uword k = 0; k < groups[g].effects.n_elem; ++k)
+			mash_posterior_effect<PosteriorTransform<false>, PosteriorOutputs<3> >(
+				groups[g].effects.at(k), b_mat, s_obj, mat(), groups[g].obs,
+				factors[g]->K, factors[g]->U0, post_mean, post_var, neg_prob,
+				zero_prob, post_cov, weights);
+	}
+	post_sd = sqrt(arma::clamp(post_var, 0.0, datum::inf));
+	lfsr.set_size(R, n);
+	for (uword i = 0; i < lfsr.n_elem; ++i) {
+		double neg = neg_prob.at(i), zero = zero_prob.at(i);
+		lfsr.at(i) = (neg > 0.5 * (1 - zero)) ? 1 - neg : neg + zero;
+	}
+}
+
+private:
+struct Factors
+{
+	cube rooti;   // inverse Cholesky factors of sigma + U_p
+	uvec ok;      // whether the factorisation of sigma + U_p succeeded
+	cube K;       // posterior factors, see get_missing_factors
+	cube U0;
+};
+
+std::shared_ptr<const Factors>
+get_factors(const vec & s) const
+{
+	std::string key(reinterpret_cast<const char *>(s.memptr()), s.n_elem * sizeof(double));
+	{
+		std::lock_guard<std::mutex> lock(factors_mutex);
+		std::map<std::string, std::shared_ptr<const Factors> >::const_iterator it = factors.find(key);
+		if (it != factors.end()) return it->second;
+	}
+	std::shared_ptr<Factors> f(new Factors);
+	mat sigma = get_cov(s, V);
+	uword R = sigma.n_rows;
+	f->rooti.set_size(R, R, U.n_slices);
+	f->ok.zeros(U.n_slices);
+	mat rooti;
+	for (uword p = 0; p < U.n_slices; ++p) {
+		if (chol_rooti(rooti, sigma + U.slice(p))) {
+			f->rooti.slice(p) = rooti;
+			f->ok.at(p) = 1;
+		}
+	}
+	get_missing_factors(sigma, arma::regspace<uvec>(0, R - 1), U, f->K, f->U0);
+	std::lock_guard<std::mutex> lock(factors_mutex);
+	// a simple bound on memory: start over when full
+	if (factors.size() >= max_factors) factors.clear();
+	factors[key] = f;
+	return f;
+}
+
+cube U;
+vec log_pi;
+mat V;
+double alpha;
+size_t max_factors;
+mutable std::mutex factors_mutex;
+mutable std::map<std::string, std::shared_ptr<const Factors> > factors;
+};
+
+// SCORINGSERVER CLASS
+// -------------------
+// @title Scoring server on a Unix domain socket
+// @description Serves the models added to it from a background thread,
+// one connection at a time. The thread never calls the R API. Requests,
+// effects, errors and busy time are counted with atomics and can be read
+// at any time.
+class ScoringServer
+{
+public:
+explicit ScoringServer(const std::string & path) :
+	path(path), listen_fd(-1), running(false), n_requests(0),
+	n_effects(0), n_errors(0), busy_ns(0)
+{
+	if (path.size() >= sizeof(((sockaddr_un *) 0)->sun_path))
+		throw std::invalid_argument("socket path is too long");
+	listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) throw std::runtime_error("cannot create socket");
+	sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+	::unlink(path.c_str());
+	if (::bind(listen_fd, (sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    ::listen(listen_fd, 16) < 0) {
+		::close(listen_fd);
+		throw std::runtime_error("cannot listen on " + path);
+	}
+	started = std::chrono::steady_clock::now();
+	running = true;
+	worker  = std::thread(&ScoringServer::serve, this);
+}
+
+~ScoringServer(){
+	stop();
+}
+
+void
+stop()
+{
+	if (!running.exchange(false)) return;
+	if (worker.joinable()) worker.join();
+	::close(listen_fd);
+	::unlink(path.c_str());
+}
+
+// @return the id of the model in requests
+uint32_t
+add_model(const std::shared_ptr<const ScoringModel> & model)
+{
+	std::lock_guard<std::mutex> lock(models_mutex);
+	models.push_back(model);
+	return models.size() - 1;
+}
+
+bool
+is_running() const
+{
+	return running;
+}
+
+double
+uptime() const
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+uint64_t requests() const { return n_requests; }
+uint64_t effects() const { return n_effects; }
+uint64_t errors() const { return n_errors; }
+double busy() const { return busy_ns * 1e-9; }
+
+private:
+void
+serve()
+{
+	pollfd pfd;
+	pfd.fd     = listen_fd;
+	pfd.events = POLLIN;
+	while (running) {
+		// wake up regularly to notice stop()
+		if (::poll(&pfd, 1, 100) <= 0) continue;
+		int fd = ::accept(listen_fd, 0, 0);
+		if (fd < 0) continue;
+		set_no_sigpipe(fd);
+		while (running && handle(fd)) {}
+		::close(fd);
+	}
+}
+
+// @return false when the connection should be closed
+bool
+handle(int fd)
+{
+	pollfd pfd;
+	pfd.fd     = fd;
+	pfd.events = POLLIN;
+	int ready;
+	while ((ready = ::poll(&pfd, 1, 100)) == 0)
+		if (!running) return false;
+	if (ready < 0) return false;
+
+	uint32_t head[4];
+	if (!read_full(fd, head, sizeof(head), &running)) return false;
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	uint32_t n = head[2], R = head[3];
+	uint32_t status = SERVER_OK;
+	std::shared_ptr<const ScoringModel> model;
+	if (head[0] != SERVER_MAGIC) status = SERVER_BAD_MAGIC;
+	else if ((uint64_t) n * R > SERVER_MAX_VALUES) status = SERVER_TOO_LARGE;
+	else {
+		std::lock_guard<std::mutex> lock(models_mutex);
+		if (head[1] >= models.size()) status = SERVER_BAD_MODEL;
+		else model = models[head[1]];
+	}
+	if (status == SERVER_OK && R != model->n_conditions()) status = SERVER_BAD_DIM;
+	if (status == SERVER_BAD_MAGIC || status == SERVER_TOO_LARGE) {
+		// the rest of the stream cannot be trusted
+		reply(fd, status, n, R);
+		++n_errors;
+		return false;
+	}
+	// R x n, one effect per column
+	mat bhat(R, n), shat(R, n);
+	if (!read_full(fd, bhat.memptr(), bhat.n_elem * sizeof(double), &running) ||
+	    !read_full(fd, shat.memptr(), shat.n_elem * sizeof(double), &running))
+		return false;
+	if (status != SERVER_OK) {
+		++n_errors;
+		return reply(fd, status, n, R);
+	}
+	mat post_mean, post_sd, lfsr;
+	try {
+		model->score(bhat, shat, post_mean, post_sd, lfsr);
+	} catch (const std::exception & e) {
+		++n_errors;
+		return reply(fd, SERVER_FAILED, n, R);
+	}
+	bool ok = reply(fd, SERVER_OK, n, R) &&
+	          write_full(fd, post_mean.memptr(), post_mean.n_elem * sizeof(double)) &&
+	          write_full(fd, post_sd.memptr(), post_sd.n_elem * sizeof(double)) &&
+	          write_full(fd, lfsr.memptr(), lfsr.n_elem * sizeof(double));
+	++n_requests;
+	n_effects += n;
+	busy_ns   += std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - t0).count();
+	return ok;
+}
+
+bool
+reply(int fd, uint32_t status, uint32_t n, uint32_t R)
+{
+	uint32_t head[4] = { SERVER_MAGIC, status, n, R };
+	return write_full(fd, head, sizeof(head));
+}
+
+std::string path;
+int listen_fd;
+std::atomic<bool> running;
+std::thread worker;
+std::mutex models_mutex;
+std::vector<std::shared_ptr<const ScoringModel> > models;
+std::chrono::steady_clock::time_point started;
+std::atomic<uint64_t> n_requests;
+std::atomic<uint64_t> n_effects;
+std::atomic<uint64_t> n_errors;
+std::atomic<uint64_t> busy_ns;
+};
+
+// @title Score a batch of effects on a running server
+// @description the client side of the protocol, for R and for tests
+// @return the status of the response
+inline uint32_t
+score_remote(const std::string & path, uint32_t model, const mat & bhat,
+             const mat & shat, mat & post_mean, mat & post_sd, mat & lfsr)
+{
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) throw std::runtime_error("cannot create socket");
+	set_no_sigpipe(fd);
+	sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+	if (::connect(fd, (sockaddr *) &addr, sizeof(addr)) < 0) {
+		::close(fd);
+		throw std::runtime_error("cannot connect to " + path);
+	}
+	uint32_t n = bhat.n_cols, R = bhat.n_rows;
+	uint32_t head[4] = { SERVER_MAGIC, model, n, R };
+	bool ok = write_full(fd, head, sizeof(head)) &&
+	          write_full(fd, bhat.memptr(), bhat.n_elem * sizeof(double)) &&
+	          write_full(fd, shat.memptr(), shat.n_elem * sizeof(double)) &&
+	          read_full(fd, head, sizeof(head));
+	if (ok && head[1] == SERVER_OK) {
+		post_mean.set_size(R, n);
+		post_sd.set_size(R, n);
+		lfsr.set_size(R, n);
+		ok = read_full(fd, post_mean.memptr(), post_mean.n_elem * sizeof(double)) &&
+		     read_full(fd, post_sd.memptr(), post_sd.n_elem * sizeof(double)) &&
+		     read_full(fd, lfsr.memptr(), lfsr.n_elem * sizeof(double));
+	}
+	::close(fd);
+	if (!ok) throw std::runtime_error("connection to " + path + " failed");
+	return head[1];
+}
+
+#endif // _WIN32
+#endif // _MASH_SERVER_H
@@ -0,0 +1,178 @@
+// NUMA placement of threads and of the large arrays of the engines
+#ifndef _MASH_NUMA_H
+#define _MASH_NUMA_H
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifdef __linux__
+# include <sched.h>
+# include <unistd.h>
+# include <sys/syscall.h>
+#endif
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+// Memory is placed on the NUMA node of the thread that first writes it.
+// The engines split effects between threads with static schedules, so
+// their outputs are first written (zeroed) and their inputs copied by
+// the same threads, in the same order, as will use them; see
+// numa_zeros and numa_copy in mash.h. Thread pinning and the
+// placement report below are only available on Linux.
+
+// PLACEMENT REPORT
+// ----------------
+const size_t NUMA_MAX_ARRAYS = 64;
+
+struct NumaThread
+{
+	int thread;
+	int cpu;
+	int node;
+};
+
+struct NumaArray
+{
+	std::string name;
+	// pages[k] on node k, and in the last element pages not yet placed
+	std::vector<long> pages;
+};
+
+struct NumaReport
+{
+	bool enabled;
+	bool pinned;
+	std::vector<NumaThread> threads;
+	std::vector<NumaArray> arrays;
+	std::mutex mutex;
+};
+
+inline NumaReport &
+numa_report()
+{
+	static NumaReport r;
+	return r;
+}
+
+inline void
+numa_report_reset(bool enabled)
+{
+	NumaReport & r = numa_report();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	r.enabled = enabled;
+	r.pinned  = false;
+	r.threads.clear();
+	r.arrays.clear();
+}
+
+// @return the number of NUMA nodes, 1 if unknown
+inline int
+numa_n_nodes()
+{
+	static const int n_nodes = []() {
+		int n = 0;
+		#ifdef __linux__
+		char path[64];
+		for (n = 0; ; ++n) {
+			std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+			if (access(path, F_OK) != 0) break;
+		}
+		#endif
+		return n > 0 ? n : 1;
+	}();
+	return n_nodes;
+}
+
+// @title The CPU and node the calling thread runs on, -1 if unknown
+inline void
+numa_where(int & cpu, int & node)
+{
+	cpu  = -1;
+	node = -1;
+	#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned c, n;
+	if (syscall(SYS_getcpu, &c, &n, NULL) == 0) {
+		cpu  = c;
+		node = n;
+	}
+	#endif
+}
+
+// @title Pin the OpenMP threads and record where they run
+// @description thread t of the team is pinned to the t-th CPU the
+// process may use, so consecutive threads, and the consecutive effect
+// blocks of a static schedule, fill one node before the next. The pool
+// of threads is reused by later parallel regions of the calling thread,
+// so the pinning lasts until that thread exits.
+inline void
+numa_setup_threads(bool pin)
+{
+	NumaReport & r = numa_report();
+	std::vector<int> cpus;
+	#ifdef __linux__
+	cpu_set_t allowed;
+	if (pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+		for (int c = 0; c < CPU_SETSIZE; ++c)
+			if (CPU_ISSET(c, &allowed)) cpus.push_back(c);
+	#endif
+	#pragma omp parallel default(none) shared(r, pin, cpus)
+	{
+		int t = 0;
+		#ifdef _OPENMP
+		t = omp_get_thread_num();
+		#endif
+		bool pinned = false;
+		#ifdef __linux__
+		if (!cpus.empty()) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[t % cpus.size()], &set);
+			pinned = sched_setaffinity(0, sizeof(set), &set) == 0;
+		}
+		#endif
+		NumaThread where;
+		where.thread = t;
+		numa_where(where.cpu, where.node);
+		std::lock_guard<std::mutex> lock(r.mutex);
+		if (pinned) r.pinned = true;
+		if (r.enabled) r.threads.push_back(where);
+	}
+}
+
+// @title Record on which nodes the pages of an array are
+inline void
+numa_record_array(const char * name, const void * p, size_t bytes)
+{
+	NumaReport & r = numa_report();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	// batches of small problems would record the same arrays many times
+	if (!r.enabled || bytes == 0 || r.arrays.size() >= NUMA_MAX_ARRAYS) return;
+	NumaArray a;
+	a.name = name;
+	a.pages.assign(numa_n_nodes() + 1, 0);
+	#if defined(__linux__) && defined(SYS_move_pages)
+	long page   = sysconf(_SC_PAGESIZE);
+	char * base = (char *) ((size_t) p & ~(size_t) (page - 1));
+	size_t n    = ((char *) p + bytes - base + page - 1) / page;
+	// a sample of the pages is enough to see the placement
+	size_t step = (n + 4095) / 4096;
+	std::vector<void *> addr;
+	for (size_t i = 0; i < n; i += step) addr.push_back(base + i * page);
+	std::vector<int> status(addr.size(), -1);
+	// with no target nodes, move_pages only reports where the pages are
+	if (syscall(SYS_move_pages, 0, addr.size(), &addr[0], NULL, &status[0], 0) == 0) {
+		for (size_t i = 0; i < status.size(); ++i) {
+			int k = status[i];
+			if (k >= 0 && k < numa_n_nodes()) a.pages[k] += step;
+			else a.pages.back() += step;
+		}
+	} else a.pages.back() = n;
+	#else
+	a.pages.back() = (bytes + 4095) / 4096;
+	#endif
+	r.arrays.push_back(a);
+}
+
+#endif // _MASH_NUMA_H
@@ -0,0 +1,139 @@
+// Progress reporting and cooperative cancellation of long computations
+#ifndef _MASH_PROGRESS_H
+#define _MASH_PROGRESS_H
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <thread>
+#include "numa.h"
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+// PROGRESS
+// --------
+// @title Progress of the running computation
+// @description engines add the work they are about to do to total, count
+// finished work in done, and skip the rest of their tiles once cancelled
+// is set. Only atomics are touched, so this is safe from any thread; the
+// R API is only ever called by the monitor below, on the main thread.
+struct Progress
+{
+	std::atomic<unsigned long long> done;
+	std::atomic<unsigned long long> total;
+	std::atomic<bool> cancelled;
+};
+
+inline Progress &
+progress()
+{
+	static Progress p;
+	return p;
+}
+
+inline void
+progress_reset()
+{
+	progress().done      = 0;
+	progress().total     = 0;
+	progress().cancelled = false;
+}
+
+inline void
+progress_expect(unsigned long long n)
+{
+	progress().total.fetch_add(n, std::memory_order_relaxed);
+}
+
+inline void
+progress_tick(unsigned long long n = 1)
+{
+	progress().done.fetch_add(n, std::memory_order_relaxed);
+}
+
+inline bool
+progress_cancelled()
+{
+	return progress().cancelled.load(std::memory_order_relaxed);
+}
+
+#ifdef Rcpp_hpp
+// seconds before the progress line is shown, so short calls stay quiet
+const double PROGRESS_DELAY = 2.0;
+
+inline void
+check_interrupt_fn(void *)
+{
+	R_CheckUserInterrupt();
+}
+
+inline bool
+option_is_true(const char * name)
+{
+	SEXP opt = Rf_GetOption1(Rf_install(name));
+	return !Rf_isNull(opt) && Rf_asLogical(opt) == TRUE;
+}
+
+// @title Run a computation in a worker thread and monitor it
+// @description f runs in a worker thread with n_thread OpenMP threads
+// while the calling (main) thread polls for user interrupts, and, unless
+// options(mashr.progress = FALSE), prints the progress, rate and ETA of
+// computations that take more than a couple of seconds. An interrupt
+// sets the cancellation flag; the engines stop at the next tile boundary
+// and the interrupt is passed on to R. f must not call the R API.
+// With options(mashr.pin_threads = TRUE) the OpenMP threads are pinned to
+// CPUs, and with options(mashr.numa_diagnostics = TRUE) the placement of
+// the threads and of the large arrays is recorded for numa_report().
+template <typename F>
+void
+run_monitored(const char * what, int n_thread, F f)
+{
+	progress_reset();
+	SEXP opt  = Rf_GetOption1(Rf_install("mashr.progress"));
+	bool show = Rf_isNull(opt) || Rf_asLogical(opt) == TRUE;
+	bool pin  = option_is_true("mashr.pin_threads");
+	numa_report_reset(option_is_true("mashr.numa_diagnostics"));
+	std::atomic<bool> finished(false);
+	std::exception_ptr error;
+	std::thread worker([&]() {
+		#ifdef _OPENMP
+		omp_set_num_threads(n_thread);
+		#endif
+		if (pin || numa_report().enabled) numa_setup_threads(pin);
+		try {
+			f();
+		} catch (...) {
+			error = std::current_exception();
+		}
+		finished = true;
+	});
+
+	typedef std::chrono::steady_clock clock;
+	clock::time_point start = clock::now(), shown = start;
+	bool printed = false;
+	while (!finished) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		if (!progress_cancelled() && !R_ToplevelExec(check_interrupt_fn, NULL))
+			progress().cancelled = true;
+		double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+		if (!show || elapsed < PROGRESS_DELAY ||
+		    std::chrono::duration<double>(clock::now() - shown).count() < 1.0)
+			continue;
+		shown = clock::now();
+		unsigned long long done = progress().done, total = progress().total;
+		double rate = done / elapsed;
+		if (total > 0 && done > 0 && done <= total)
+			REprintf("\r%s: %llu/%llu (%.0f%%), %.3g/s, ETA %.0fs   ", what, done,
+			         total, 100.0 * done / total, rate, (total - done) / rate);
+		else
+			REprintf("\r%s: %llu, %.3g/s   ", what, done, rate);
+		printed = true;
+	}
+	worker.join();
+	if (printed) REprintf("\n");
+	if (progress_cancelled()) throw Rcpp::internal::InterruptedException();
+	if (error) std::rethrow_exception(error);
+}
+#endif // Rcpp_hpp
+#endif // _MASH_PROGRESS_H